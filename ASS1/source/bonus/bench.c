@@ -0,0 +1,156 @@
+// Benchmarks for the pstree tree construction code.
+// Builds synthetic process tables of increasing size and times
+// build_pid_index() + build_process_tree() on each of them, reports the
+// memory used by a 50k-process table, stress tests the table growth and
+// compares child sorting against qsort() on one very wide parent.
+#define PSTREE_NO_MAIN
+#include "pstree.c"
+
+#include <sys/resource.h>
+
+static const char *bench_names[] = {
+    "systemd", "kworker", "sshd", "bash", "nginx", "java", "python3", "containerd-shim"
+};
+
+// Fill the process table with count synthetic processes, each one
+// parented to a random earlier PID so the result is a single tree
+void make_synthetic_processes(int count) {
+    srand(3150);
+    for (int i = 0; i < count; i++) {
+        process_t *proc = alloc_process(&process_arena);
+        proc->pid = i + 1;
+        proc->ppid = i == 0 ? 0 : 1 + rand() % i;
+        proc->pgid = proc->pid;
+        proc->uid = 0;
+        proc->comm = intern(&comm_names,
+                            bench_names[rand() % (sizeof(bench_names) / sizeof(bench_names[0]))]);
+        
+        char cmdline[128];
+        int len = snprintf(cmdline, sizeof(cmdline), "/usr/bin/%s --worker %d", proc->comm, i);
+        proc->cmdline = arena_strndup(&process_arena, cmdline, len);
+        table_append(proc);
+    }
+}
+
+void bench_tree_build(void) {
+    printf("%10s %12s %12s\n", "processes", "index_ms", "build_ms");
+    for (int count = 1000; count <= 64000; count *= 2) {
+        make_synthetic_processes(count);
+        
+        double start = now_ms();
+        build_pid_index();
+        double indexed = now_ms();
+        build_process_tree();
+        double built = now_ms();
+        
+        printf("%10d %12.3f %12.3f\n", count, indexed - start, built - indexed);
+        free_processes();
+    }
+}
+
+void bench_memory(void) {
+    struct rusage before, after;
+    int count = 50000;
+    
+    getrusage(RUSAGE_SELF, &before);
+    unsigned long chunks = arena_chunk_count;
+    make_synthetic_processes(count);
+    build_pid_index();
+    build_process_tree();
+    getrusage(RUSAGE_SELF, &after);
+    
+    printf("\n%d processes: record %zu bytes, %lu arena chunks, %d distinct names\n",
+           count, sizeof(process_t), arena_chunk_count - chunks, comm_names.count);
+    printf("peak RSS %ld KB (grew by %ld KB)\n", after.ru_maxrss,
+           after.ru_maxrss - before.ru_maxrss);
+    free_processes();
+}
+
+// Stress test for the growable table: push well over 100k synthetic entries
+// through table_append() (the path the scanner merges through) and check
+// that nothing is truncated and the cost per entry stays flat.
+int bench_stress(void) {
+    printf("\n%10s %12s %12s %12s %14s\n",
+           "entries", "append_ms", "index_ms", "build_ms", "ns_per_entry");
+    for (int count = 50000; count <= 400000; count *= 2) {
+        double start = now_ms();
+        make_synthetic_processes(count);
+        double appended = now_ms();
+        build_pid_index();
+        double indexed = now_ms();
+        build_process_tree();
+        double built = now_ms();
+        
+        if (process_count != count || !find_process(count)) {
+            fprintf(stderr, "table truncated: %d of %d entries\n", process_count, count);
+            return 1;
+        }
+        printf("%10d %12.3f %12.3f %12.3f %14.1f\n", count, appended - start,
+               indexed - appended, built - indexed, (built - start) * 1e6 / count);
+        free_processes();
+    }
+    return 0;
+}
+
+// One parent with count kworker-style children in shuffled order, as under
+// kthreadd: time qsort() with process_compare() against sort_processes(),
+// by name and with -n, and check both give the same order. The PIDs are
+// unique and process_compare() breaks ties by PID, so the order is total
+// and does not depend on qsort() being stable.
+int bench_wide_sort(void) {
+    printf("\n%10s %6s %12s %12s\n", "children", "order", "qsort_ms", "keys_ms");
+    for (int count = 4000; count <= 64000; count *= 4) {
+        process_t **by_qsort = malloc(count * sizeof(process_t *));
+        process_t **by_keys = malloc(count * sizeof(process_t *));
+        if (!by_qsort || !by_keys) {
+            perror("malloc");
+            exit(1);
+        }
+        srand(3150);
+        for (int i = 0; i < count; i++) {
+            process_t *proc = alloc_process(&process_arena);
+            proc->pid = 2 + i;
+            char name[32];
+            int len = snprintf(name, sizeof(name), "kworker/%d:%d-events", rand() % 64, rand() % 8);
+            proc->comm = intern(&comm_names, arena_strndup(&process_arena, name, len));
+            by_qsort[i] = proc;
+        }
+        for (int i = count - 1; i > 0; i--) {
+            int j = rand() % (i + 1);
+            process_t *swap = by_qsort[i];
+            by_qsort[i] = by_qsort[j];
+            by_qsort[j] = swap;
+        }
+        
+        for (int numeric = 0; numeric <= 1; numeric++) {
+            options.numeric_sort = numeric;
+            memcpy(by_keys, by_qsort, count * sizeof(process_t *));
+            double start = now_ms();
+            qsort(by_qsort, count, sizeof(process_t *), process_compare);
+            double sorted = now_ms();
+            sort_processes(by_keys, count);
+            double keyed = now_ms();
+            
+            if (memcmp(by_qsort, by_keys, count * sizeof(process_t *)) != 0) {
+                fprintf(stderr, "sort_processes() order differs from qsort()\n");
+                return 1;
+            }
+            printf("%10d %6s %12.3f %12.3f\n", count, numeric ? "pid" : "name",
+                   sorted - start, keyed - sorted);
+        }
+        options.numeric_sort = 0;
+        free(by_qsort);
+        free(by_keys);
+        free_processes();
+    }
+    return 0;
+}
+
+int main(void) {
+    bench_memory();
+    bench_tree_build();
+    if (bench_stress() != 0 || bench_wide_sort() != 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,230 @@
+// Generate a synthetic /proc tree for benchmarking pstree --proc-root.
+// Writes [pid]/stat, status, cmdline, task/[tid]/comm and
+// task/[tid]/children for every process plus loadavg, laid out as a
+// breadth-first tree below PID 1.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+// Generator options
+struct {
+    int count;          // -n processes
+    int fanout;         // -f children per process
+    int depth;          // -d maximum tree depth
+    int threads;        // -t extra threads per process
+    int cmdline_len;    // -c cmdline length in bytes
+    const char *output; // -o directory
+} config = {1000, 8, 6, 0, 64, "fixture"};
+
+// Names repeat per depth so identical sibling subtrees appear
+static const char *names[] = {
+    "systemd", "containerd", "containerd-shim", "nginx", "java", "python3",
+    "sshd", "bash", "kworker", "postgres", "redis-server", "node"
+};
+#define NAME_COUNT (int)(sizeof(names) / sizeof(names[0]))
+
+// Create a directory, existing directories are fine
+void make_dir(const char *path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        perror(path);
+        exit(1);
+    }
+}
+
+// Write len bytes of data to path
+void write_file(const char *path, const char *data, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    if (write(fd, data, len) != (ssize_t)len) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+}
+
+// Build a NUL-separated command line of about config.cmdline_len bytes
+size_t make_cmdline(char *buf, size_t size, const char *name, int pid) {
+    size_t len = snprintf(buf, size, "/usr/bin/%s", name) + 1;
+    int arg = 0;
+    while (len < (size_t)config.cmdline_len && len + 32 < size) {
+        len += snprintf(buf + len, size - len, "--opt%d=%d", arg++, pid) + 1;
+    }
+    return len;
+}
+
+// Write all files of one process. first_child/next_sibling link the
+// children of every PID in increasing order.
+void write_process(int pid, int ppid, int depth, int first_tid,
+                   const int *first_child, const int *next_sibling) {
+    char path[4096];
+    char data[8192];
+    const char *name = names[depth % NAME_COUNT];
+    int num_threads = config.threads + 1;
+
+    snprintf(path, sizeof(path), "%s/%d", config.output, pid);
+    make_dir(path);
+
+    // Field layout as in proc(5), 52 fields
+    int len = snprintf(data, sizeof(data),
+                       "%d (%s) S %d %d %d 0 -1 4194560 100 0 0 0 %d %d 0 0 20 0 %d 0 %d "
+                       "10000000 %d 18446744073709551615 1 1 0 0 0 0 0 0 0 0 0 0 17 0 "
+                       "0 0 0 0 0 0 0 0 0 0 0 0 0\n",
+                       pid, name, ppid, pid, pid, pid % 97, pid % 13, num_threads,
+                       1000 + pid, 100 + pid % 1000);
+    snprintf(path, sizeof(path), "%s/%d/stat", config.output, pid);
+    write_file(path, data, len);
+
+    len = snprintf(data, sizeof(data),
+                   "Name:\t%s\nState:\tS (sleeping)\nTgid:\t%d\nPid:\t%d\nPPid:\t%d\n"
+                   "Uid:\t0\t0\t0\t0\nGid:\t0\t0\t0\t0\nThreads:\t%d\n",
+                   name, pid, pid, ppid, num_threads);
+    snprintf(path, sizeof(path), "%s/%d/status", config.output, pid);
+    write_file(path, data, len);
+
+    size_t cmdline_len = make_cmdline(data, sizeof(data), name, pid);
+    snprintf(path, sizeof(path), "%s/%d/cmdline", config.output, pid);
+    write_file(path, data, cmdline_len);
+
+    // task/[tid]/comm for the main thread and each extra thread
+    snprintf(path, sizeof(path), "%s/%d/task", config.output, pid);
+    make_dir(path);
+    for (int i = 0; i < num_threads; i++) {
+        int tid = i == 0 ? pid : first_tid + i - 1;
+        snprintf(path, sizeof(path), "%s/%d/task/%d", config.output, pid, tid);
+        make_dir(path);
+
+        len = i == 0 ? snprintf(data, sizeof(data), "%s\n", name)
+                     : snprintf(data, sizeof(data), "worker-%d\n", i % 4);
+        snprintf(path, sizeof(path), "%s/%d/task/%d/comm", config.output, pid, tid);
+        write_file(path, data, len);
+
+        // The main thread forked all the children: "pid pid ... " as in
+        // the kernel's format, without a newline
+        char *children = NULL;
+        size_t children_len = 0;
+        FILE *stream = open_memstream(&children, &children_len);
+        if (!stream) {
+            perror("open_memstream");
+            exit(1);
+        }
+        for (int child = i == 0 ? first_child[pid] : 0; child; child = next_sibling[child]) {
+            fprintf(stream, "%d ", child);
+        }
+        fclose(stream);
+        snprintf(path, sizeof(path), "%s/%d/task/%d/children", config.output, pid, tid);
+        write_file(path, children, children_len);
+        free(children);
+    }
+}
+
+void print_usage(void) {
+    printf("Usage: mkproc [options]\n");
+    printf("Write a synthetic /proc tree for pstree --proc-root.\n\n");
+    printf("  -n COUNT   number of processes (default 1000)\n");
+    printf("  -f FANOUT  children per process (default 8)\n");
+    printf("  -d DEPTH   maximum tree depth (default 6)\n");
+    printf("  -t COUNT   extra threads per process (default 0)\n");
+    printf("  -c BYTES   cmdline length (default 64)\n");
+    printf("  -o DIR     output directory (default fixture)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int option;
+    while ((option = getopt(argc, argv, "n:f:d:t:c:o:h")) != -1) {
+        switch (option) {
+            case 'n':
+                config.count = atoi(optarg);
+                break;
+            case 'f':
+                config.fanout = atoi(optarg);
+                break;
+            case 'd':
+                config.depth = atoi(optarg);
+                break;
+            case 't':
+                config.threads = atoi(optarg);
+                break;
+            case 'c':
+                config.cmdline_len = atoi(optarg);
+                break;
+            case 'o':
+                config.output = optarg;
+                break;
+            case 'h':
+                print_usage();
+                return 0;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+    if (config.count < 1 || config.fanout < 1 || config.depth < 1 || config.threads < 0) {
+        print_usage();
+        return 1;
+    }
+
+    // Breadth-first layout: PIDs 1..count, parent of each PID is recorded in
+    // parents[], thread IDs are numbered after the last PID
+    int *parents = calloc(config.count + 1, sizeof(int));
+    int *depths = calloc(config.count + 1, sizeof(int));
+    int *first_child = calloc(config.count + 1, sizeof(int));
+    int *next_sibling = calloc(config.count + 1, sizeof(int));
+    if (!parents || !depths || !first_child || !next_sibling) {
+        perror("calloc");
+        return 1;
+    }
+
+    int next_parent = 1;
+    int children_of_parent = 0;
+    for (int pid = 2; pid <= config.count; pid++) {
+        // Move on when the current parent is full or too deep to have children
+        while (children_of_parent >= config.fanout || depths[next_parent] >= config.depth) {
+            next_parent++;
+            children_of_parent = 0;
+            if (next_parent >= pid) {
+                // Every slot within the depth limit is used, widen the root
+                next_parent = 1;
+                children_of_parent = -config.count;
+                break;
+            }
+        }
+        parents[pid] = next_parent;
+        depths[pid] = depths[next_parent] + 1;
+        children_of_parent++;
+    }
+
+    // Link the children of each PID, lowest PID first
+    for (int pid = config.count; pid >= 2; pid--) {
+        next_sibling[pid] = first_child[parents[pid]];
+        first_child[parents[pid]] = pid;
+    }
+
+    make_dir(config.output);
+    int next_tid = config.count + 1;
+    for (int pid = 1; pid <= config.count; pid++) {
+        write_process(pid, parents[pid], depths[pid], next_tid, first_child, next_sibling);
+        next_tid += config.threads;
+    }
+
+    char path[4096];
+    char data[128];
+    int len = snprintf(data, sizeof(data), "0.00 0.00 0.00 1/%d %d\n",
+                       config.count * (config.threads + 1), next_tid - 1);
+    snprintf(path, sizeof(path), "%s/loadavg", config.output);
+    write_file(path, data, len);
+
+    free(parents);
+    free(depths);
+    free(first_child);
+    free(next_sibling);
+    return 0;
+}
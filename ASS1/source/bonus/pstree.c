@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,11 +6,28 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <pwd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
 
-#define MAX_PROCESSES 65536
-#define MAX_CMDLINE 1024
+#define MAX_CMDLINE 1024    // Command line length shown without -l
 #define MAX_COMM 256
+#define ARENA_CHUNK_SIZE (256 * 1024)
 
 // Process structure
 typedef struct process {
@@ -17,15 +35,53 @@ typedef struct process {
     int ppid;
     int uid;
     int pgid;           // Process group ID
-    char comm[MAX_COMM];
-    char cmdline[MAX_CMDLINE];
-    struct process **children;
+    const char *comm;   // Interned, shared by all processes with this name
+    const char *cmdline; // Arena string, NULL until proc_cmdline() reads it
+    char *cmdline_buffer; // Owned cmdline under --watch and --daemon, freed when recycled
+    unsigned long long starttime; // Tells a reused PID apart from the original
+    unsigned long long utime;   // CPU time in clock ticks, user and system
+    unsigned long long stime;
+    unsigned long long rss;     // Resident set size in pages
+    struct process *parent;
+    struct process *next_by_uid; // Next process of the same uid in uid_index
+    struct process **children; // Slice of child_pool, or owned if child_capacity > 0
     int child_count;
-    int child_capacity;
+    int child_capacity; // Size of an owned children array (--watch)
+    int table_index;    // Position in processes[]
     int thread_count;   // Number of threads for this process
     int is_thread;      // Whether this is a thread (name in {})
+    int is_highlighted; // On the path from the -H process to the root
+    int diff_state;     // DIFF_* change between the two --diff tables
+    int diff_shown;     // Inside or above a change, displayed by --diff
+    unsigned long long subtree_hash; // Structural hash, for N*[subtree] merging
+    unsigned long long total_rss;   // Sums over the subtree, see compute_subtree_totals()
+    unsigned long long total_cpu;
+    int total_processes;
+    int total_threads;
 } process_t;
 
+// Bump allocator: process records and strings are carved out of large
+// chunks and released all at once
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} arena_chunk_t;
+
+typedef struct {
+    arena_chunk_t *head;
+} arena_t;
+
+// String interning table (open addressing). New strings are copied into
+// arena; a table without an arena keeps the caller's pointers instead.
+typedef struct {
+    const char **slots;
+    unsigned int mask;
+    int count;
+    arena_t *arena;
+} intern_table_t;
+
 // Global options
 struct {
     int show_pids;      // -p
@@ -38,25 +94,587 @@ struct {
     int compact_not;    // -c
     int highlight_pid;  // -H PID
     int show_threads;   // -t
+    int jobs;           // --jobs N
+    int stats;          // --stats
+    const char *proc_root; // --proc-root DIR
+    double watch_interval; // --watch SECONDS, 0 when not watching
+    int follow;         // --follow
+    const char *save_file; // --save FILE
+    const char *load_file; // --load FILE
+    const char *diff_from; // --diff A B, each a snapshot file or "live"
+    const char *diff_to;
+    int subtree_pid;    // Only read this PID and its descendants, 0 for all
+    int show_totals;    // --totals
+    int sort_key;       // --sort, SORT_* order of siblings
+    const char *user;   // USER argument: only trees rooted at their processes
+    int user_uid;
+    int format;         // --format, FORMAT_*
+    int daemon;         // --daemon
+    const char *socket_path; // --socket PATH, of the daemon or to query
+    double max_age;     // --max-age SECONDS, -1 when not given
+    int io_uring;       // --io-uring
 } options = {0};
 
-// Global process table
-process_t *processes[MAX_PROCESSES];
+// Long-only options
+enum {
+    OPT_JOBS = 256,
+    OPT_STATS,
+    OPT_PROC_ROOT,
+    OPT_WATCH,
+    OPT_FOLLOW,
+    OPT_SAVE,
+    OPT_LOAD,
+    OPT_DIFF,
+    OPT_TOTALS,
+    OPT_SORT,
+    OPT_FORMAT,
+    OPT_DAEMON,
+    OPT_SOCKET,
+    OPT_MAX_AGE,
+    OPT_IO_URING
+};
+
+// Output formats of --format
+enum {
+    FORMAT_TEXT,
+    FORMAT_JSON,        // One array of nested {..., "children": [...]} trees
+    FORMAT_NDJSON       // One object per line, linked by ppid
+};
+
+// Sibling orders of --sort, largest subtree total first
+enum {
+    SORT_NONE,
+    SORT_RSS,
+    SORT_CPU
+};
+
+// Timed phases of a run, for --stats
+enum {
+    PHASE_SCAN,
+    PHASE_BUILD,
+    PHASE_SORT,         // Ordering children, paused out of build and print
+    PHASE_PRINT,
+    PHASE_COUNT
+};
+
+const char *phase_names[PHASE_COUNT] = {"scan", "build", "sort", "print"};
+double phase_ms[PHASE_COUNT];
+int phase_stack[PHASE_COUNT];   // Phases being timed, innermost last
+int phase_depth = 0;
+double phase_started;           // now_ms() when the innermost phase (re)started
+double run_started;             // now_ms() at startup, for time.total_ms
+
+// Per-process data fetched from /proc, only what the options need is read
+enum {
+    FIELD_STAT,         // stat: pid, comm, ppid, pgid, threads, CPU, RSS (always read)
+    FIELD_UID,          // owner of /proc/[pid], for -u
+    FIELD_CMDLINE,      // cmdline, for -a (read when printed)
+    FIELD_THREADS,      // task/[tid]/comm, for -t
+    FIELD_COUNT
+};
+
+const char *field_names[FIELD_COUNT] = {"stat", "uid", "cmdline", "threads"};
+unsigned int needed_fields = 1u << FIELD_STAT;
+unsigned long syscall_counts[FIELD_COUNT];  // Syscalls made per field, for --stats
+const char *scan_backend = "sync";          // How the last scan read /proc, for --stats
+
+// Work done reading /proc, for --stats. Scanner threads update these with
+// atomic adds.
+struct {
+    unsigned long files_opened;
+    unsigned long bytes_read;
+    unsigned long records;      // Process records allocated
+    unsigned long uring_sqes;   // Requests submitted through io_uring
+} io_counts;
+
+// One PID directory of the proc root. --watch and --daemon keep the
+// starttime of the process read from it to spot reused PIDs, 0 until then.
+typedef struct {
+    int pid;
+    unsigned long long starttime;
+} pid_entry_t;
+
+// Work slice for one scanner thread
+typedef struct {
+    pthread_t thread;
+    int thread_started;
+    pid_entry_t *pids;      // Slice of the PID list to read
+    int count;
+    process_t **results;    // Thread-local buffer of records read
+    int result_count;
+    int result_capacity;
+    arena_t arena;          // Thread-local storage for records and strings
+    intern_table_t names;   // Thread-local comm interning
+    process_t *recycled;    // Records to reuse before allocating (--watch)
+    int used_uring;         // Set when the slice was read through io_uring
+} scan_job_t;
+
+// io_uring scan (--io-uring). Each scanner thread has its own ring and
+// keeps URING_SLOTS PIDs in flight: per PID a linked openat -> read ->
+// close of stat into a direct descriptor, plus a statx of the PID
+// directory when the uid is needed. A slot is refilled with the next PID
+// as soon as all completions of its current one have arrived.
+#define URING_SLOTS 256
+#define URING_STAT_SIZE 4096
+
+enum {
+    URING_OPEN,
+    URING_READ,
+    URING_CLOSE,
+    URING_STATX
+};
+
+typedef struct {
+    int index;              // Position in the job's PID list
+    int pending;            // Completions still to come
+    int stat_len;           // Bytes read from stat, <= 0 if it failed
+    char path[24];          // "[pid]/stat", "[pid]" for statx
+    char dir[16];
+    struct statx statx;
+    char stat[URING_STAT_SIZE];
+} uring_slot_t;
+
+typedef struct {
+    int fd;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned queued;        // SQEs written but not submitted yet
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_map;
+    size_t ring_size;
+    void *cq_map;           // Separate CQ mapping on kernels without SINGLE_MMAP
+    size_t cq_size;
+    void *sqe_map;
+    size_t sqe_size;
+} uring_t;
+
+// Global process table, grown as needed
+process_t **processes = NULL;
 int process_count = 0;
+int process_capacity = 0;
+
+// Storage for all records and strings in the table, and the children
+// arrays of every process as one contiguous array. comm_names refers to
+// strings already interned by the scanner threads.
+arena_t process_arena = {0};
+intern_table_t comm_names = {0};
+process_t **child_pool = NULL;
+unsigned long arena_chunk_count = 0;  // Chunks allocated, for benchmarks
+
+// Directory fd for /proc, all per-process files are opened relative to it
+int proc_fd = -1;
+
+// PID -> process lookup table (open addressing, linear probing)
+typedef struct {
+    process_t **slots;
+    unsigned int mask;  // capacity - 1, capacity is a power of two
+} pid_index_t;
+
+pid_index_t pid_index = {0};
+
+// uid -> processes lookup for the USER argument. Each slot holds the
+// first process of one uid, the others follow through next_by_uid.
+pid_index_t uid_index = {0};
+
+// uid -> user name cache for -u (open addressing, linear probing). The
+// first lookup fills it with one getpwent() pass; uids that pass did not
+// list (e.g. NSS backends that do not enumerate) are asked for once with
+// getpwuid() and cached too, with a NULL name when there is no such user.
+typedef struct {
+    int uid;
+    const char *name;
+    int used;
+} user_entry_t;
+
+struct {
+    user_entry_t *slots;
+    unsigned int mask;
+    int count;
+    int loaded;         // The getpwent() pass has been made
+    arena_t arena;      // Name strings
+} user_names = {0};
+
+// A growable byte buffer
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} byte_buffer_t;
+
+// Output is formatted into one large buffer and written with write()/writev()
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+
+struct {
+    char data[OUTPUT_BUFFER_SIZE];
+    size_t len;
+    int fd;
+    unsigned long lines;            // Lines printed, for --stats
+    unsigned long bytes_written;
+    byte_buffer_t *capture;         // Collect output here instead of writing it
+    int trees;                      // Trees printed as --format json
+} output = {.fd = STDOUT_FILENO};
+
+// Tree prefix shared by the whole traversal: each level appends its
+// continuation characters and the stack restores the length on the way back
+struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} prefix = {0};
+
+// One level of the explicit traversal stack
+typedef struct {
+    process_t *proc;        // Node whose children are being printed
+    size_t prefix_len;      // Prefix length for those children
+    int next_child;         // Next index into proc->children
+    int remaining;          // Displayed children not printed yet
+    int closers;            // ']' to close after the last line below proc
+    int printed;            // Children printed so far (--format json)
+} print_frame_t;
+
+// Children arrays of the subtree being printed. Grouping identical
+// subtrees and --sort reorder these copies, so the table's own arrays stay
+// in the order insert_child() and the next render expect.
+struct {
+    process_t **nodes;      // Nodes whose children point into pool, breadth-first
+    process_t ***saved;     // Their own children arrays, put back afterwards
+    int node_count;
+    int node_capacity;
+    process_t **pool;
+    int pool_capacity;
+} render_order = {0};
+
+// Sort key for grouping identical sibling subtrees
+typedef struct {
+    process_t *proc;
+    int index;              // Position among the siblings
+    int group;              // Position of the first sibling with the same hash
+} sibling_key_t;
+
+// Precomputed ordering of one child, compared as integers instead of by
+// chasing proc->comm. The name is the first 16 bytes of comm, which holds
+// all of a kernel comm (TASK_COMM_LEN); longer names fall back to strcmp.
+// The PID comes last and breaks every tie.
+typedef struct {
+    uint64_t rank;          // --sort: ~subtree total, so larger comes first
+    uint64_t words[3];      // comm big-endian in [0] and [1] (0 for -n), biased PID in [2]
+    process_t *proc;
+} child_key_t;
+
+#define SORT_INSERTION_MAX 16   // Runs sorted by insertion before merging
+
+// Key arrays reused by every sort_processes() call
+struct {
+    child_key_t *keys;
+    child_key_t *scratch;
+    int capacity;
+} sort_buffer;
+
+struct {
+    print_frame_t *frames;
+    int depth;
+    int capacity;
+} print_stack = {0};
+
+// State kept between --watch refreshes. The sorted PID list of the last
+// scan is diffed against a fresh readdir so only new, exited and reused
+// PIDs are touched; records of exited processes are recycled through
+// job.recycled and re-read processes share job's arena and names.
+struct {
+    pid_entry_t *pids;      // Sorted by PID
+    int pid_count;
+    scan_job_t job;         // Storage for records read by refreshes
+    process_t **orphans;    // Processes whose parent exited this refresh
+    int orphan_count;
+    int orphan_capacity;
+    int added;              // Changes found by the last refresh
+    int exited;
+    int changed;
+    byte_buffer_t frame;    // Tree text of the frame being drawn
+    byte_buffer_t shown;    // Tree text currently on the terminal
+    int shown_rows;         // Rows of shown actually drawn
+    int terminal_rows;
+} watch = {0};
+
+volatile sig_atomic_t watch_stop = 0;
+
+// Process events counted by --follow
+enum {
+    EVENT_FORK,
+    EVENT_EXEC,
+    EVENT_EXIT,
+    EVENT_COUNT
+};
+
+const char *event_names[EVENT_COUNT] = {"fork", "exec", "exit"};
+
+// --follow state: the proc connector socket and event counters
+struct {
+    int socket_fd;
+    unsigned long events[EVENT_COUNT];  // Since the last view
+    unsigned long total[EVENT_COUNT];
+    unsigned long lost;                 // Receive buffer overruns
+    int resync;                         // Events were lost, rescan
+} follow = {.socket_fd = -1};
+
+// Binary snapshot written by --save and mapped by --load. The file is a
+// header, a fixed-size record per table entry, a string table and an
+// array of child record indices. Everything is addressed by offset or
+// index so the file can be mapped anywhere; integers are in host order,
+// checked through byte_order.
+#define SNAPSHOT_MAGIC "PSTSNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define SNAPSHOT_NONE 0xffffffffu
+#define SNAPSHOT_BY_PID 1u
+
+typedef struct {
+    char magic[8];              // SNAPSHOT_MAGIC, NUL padded
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t record_count;
+    uint32_t child_count;       // Entries in the child index array
+    uint32_t flags;             // SNAPSHOT_BY_PID: children are in PID order
+    uint32_t reserved;
+    uint64_t records_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t children_offset;
+} snapshot_header_t;
+
+typedef struct {
+    int32_t pid;
+    int32_t ppid;
+    int32_t uid;
+    int32_t pgid;
+    int32_t thread_count;
+    uint32_t is_thread;
+    uint64_t starttime;
+    uint64_t utime;
+    uint64_t stime;
+    uint64_t rss;
+    uint32_t comm;              // Offset into the string table
+    uint32_t cmdline;
+    uint32_t parent;            // Record index, SNAPSHOT_NONE for roots
+    uint32_t first_child;       // Index into the child index array
+    uint32_t child_count;
+    uint32_t reserved;
+} snapshot_record_t;
+
+// String table being written: each distinct string is stored once, so
+// equal names in a loaded snapshot share one pointer like interned ones
+typedef struct {
+    const char **keys;
+    uint32_t *offsets;
+    unsigned int mask;
+    int count;
+    byte_buffer_t data;
+} snapshot_strings_t;
+
+// The mapping of a loaded snapshot, strings point straight into it
+struct {
+    void *map;
+    size_t size;
+} snapshot = {0};
+
+// --daemon state. The table is refreshed like --watch does, but only when
+// a request finds it older than the allowed age. Requests are served one
+// at a time from the table, so the children arrays are resorted only when
+// a request wants another order than the previous one.
+#define DAEMON_MAX_AGE 1.0          // Seconds, when --max-age is not given
+#define DAEMON_MAX_REQUEST 65536    // Bytes of arguments in one request
+#define DAEMON_TIMEOUT_MS 1000      // Waiting for a client to send or receive
+
+struct {
+    int listen_fd;
+    double refreshed_at;        // now_ms() when the table was last read
+    int numeric_order;          // Children are sorted by PID rather than name
+    int highlighted;            // A -H path is marked in the table
+    byte_buffer_t request;
+    byte_buffer_t response;
+    unsigned long requests;     // Counters since start, for --stats
+    unsigned long errors;
+    unsigned long refreshes;
+    double latency_total_ms;
+    double latency_max_ms;
+} server = {.listen_fd = -1};
+
+// Change of a process between the two tables of --diff
+enum {
+    DIFF_SAME,
+    DIFF_ADDED,         // Only in B
+    DIFF_REMOVED,       // Only in A
+    DIFF_REPARENTED     // In both, under a different parent
+};
+
+// One input table of --diff, moved out of the globals once it is read.
+// order holds the processes (no thread records) sorted by (pid,
+// starttime); merged maps a table index to the node of the diff tree.
+typedef struct {
+    process_t **processes;
+    int count;
+    arena_t arena;
+    process_t **child_pool;
+    void *map;
+    size_t map_size;
+    process_t **order;
+    int order_count;
+    process_t **merged;
+} diff_side_t;
 
 // Function prototypes
 int is_number(const char *str);
-int read_process_info(int pid, process_t *proc);
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+void arena_adopt(arena_t *arena, arena_t *other);
+void arena_free(arena_t *arena);
+unsigned int string_hash(const char *str);
+const char *intern(intern_table_t *table, const char *str);
+void intern_free(intern_table_t *table);
+process_t *alloc_process(arena_t *arena);
+process_t *job_alloc_process(scan_job_t *job);
+void count_syscalls(int field, int count);
+void count_io(int files, ssize_t bytes);
+void compute_needed_fields(void);
+double now_ms(void);
+void phase_begin(int phase);
+void phase_end(void);
+void print_stats(void);
+ssize_t read_file_at(int dirfd, const char *name, char *buf, size_t size, int field);
+int parse_stat(char *buf, process_t *proc, char *comm);
+void job_append(scan_job_t *job, process_t *proc);
+void load_threads(int pid_fd, process_t *proc, scan_job_t *job);
+int parse_process_info(char *stat, int pid, process_t *proc, scan_job_t *job);
+int read_process_info(int pid_fd, int pid, process_t *proc, scan_job_t *job);
+const char *proc_cmdline(process_t *proc);
+void reserve_processes(int capacity);
+void table_append(process_t *proc);
+int estimate_table_size(int pid_count);
+int read_pid_list(pid_entry_t **list);
+void pid_list_append(pid_entry_t **list, int *count, int *capacity, int pid);
+int read_children(int task_fd, const char *tid, pid_entry_t **list, int *count, int *capacity);
+int read_subtree_pids(int root_pid, pid_entry_t **list);
 void scan_processes(void);
+void load_process(int pid, scan_job_t *job);
+void *scan_worker(void *arg);
+int uring_setup(uring_t *ring, unsigned entries);
+void uring_free(uring_t *ring);
+struct io_uring_sqe *uring_sqe(uring_t *ring, int opcode, int slot, int op);
+int uring_enter(uring_t *ring, unsigned wait);
+void uring_start(uring_t *ring, uring_slot_t *slots, int slot, scan_job_t *job, int index);
+int uring_scan(scan_job_t *job);
+void scan_parallel(pid_entry_t *pids, int pid_count, int jobs);
+unsigned int pid_hash(int pid);
+void build_pid_index(void);
+process_t *find_process(int pid);
+void pid_index_insert(process_t *proc);
+void pid_index_remove(process_t *proc);
+void build_uid_index(void);
+int process_depth(process_t *proc);
+int tree_order_compare(const void *a, const void *b);
+void print_user_trees(int uid, int top_pid);
 void build_process_tree(void);
-void print_tree(process_t *proc, const char *prefix, int is_last);
-void print_compact_tree(process_t *proc, const char *prefix, int is_last);
+void link_children(void);
+void sort_children(void);
+void insert_child(process_t *parent, process_t *child);
+void remove_child(process_t *parent, process_t *child);
+void buffer_append(byte_buffer_t *buffer, const char *data, size_t len);
+void out_write(const char *data, size_t len);
+void out_str(const char *str);
+void out_int(int value);
+void out_flush(void);
+void prefix_push(const char *str, size_t len);
+void push_frame(process_t *proc, int visible_children);
+void print_branch(int is_last);
+void print_node(process_t *proc, int show_thread_count);
+const char *user_cache_insert(int uid, const char *name);
+void load_user_names(void);
+const char *user_name(int uid);
+void print_thread_count(process_t *proc);
+size_t format_totals(process_t *proc, char *buf, size_t size);
+void compute_subtree_totals(process_t *root);
+void print_tree(process_t *root);
+int visible_child_count(process_t *proc);
+process_t *first_visible_child(process_t *proc);
+unsigned long long node_label_hash(process_t *proc);
+unsigned long long mix_hash(unsigned long long hash);
+int hash_compare(const void *a, const void *b);
+int group_compare(const void *a, const void *b);
+int sibling_hash_compare(const void *a, const void *b);
+void group_sibling_run(process_t **run, int count, sibling_key_t *keys);
+void group_identical_subtrees(process_t *root);
+void render_order_push(process_t *proc);
+void render_order_begin(process_t *root);
+void render_order_end(void);
+process_t *print_compact_node(process_t *proc, int is_last, int group_count, int closers);
+void print_compact_tree(process_t *root);
+void out_json_string(const char *str);
+void print_json_node(process_t *proc);
+void print_json_tree(process_t *root);
 void free_processes(void);
 int process_compare(const void *a, const void *b);
-int is_ancestor_of(int ancestor_pid, int descendant_pid);
+void make_child_key(process_t *proc, child_key_t *key);
+int child_key_compare(const child_key_t *a, const child_key_t *b);
+void insertion_sort_keys(child_key_t *keys, int count);
+void merge_sort_keys(child_key_t *keys, child_key_t *scratch, int count);
+void radix_sort_keys(child_key_t *keys, child_key_t *scratch, int count);
+void sort_processes(process_t **array, int count);
+void mark_highlight_path(void);
 int should_highlight(process_t *proc);
 void merge_threads(void);
 int is_thread_name(const char *name);
+int is_hidden(process_t *proc);
+int pid_entry_compare(const void *a, const void *b);
+void table_remove(process_t *proc);
+void recycle_process(process_t *proc);
+void detach_process(process_t *proc);
+void reattach_orphan(process_t *proc);
+int refresh_stat(process_t *proc, pid_entry_t *entry);
+void attach_loaded_processes(void);
+void refresh_processes(void);
+void print_view(process_t *root, int target_pid);
+void draw_watch_frame(int target_pid, const char *header);
+void watch_signal(int sig);
+void catch_watch_signals(void);
+int watch_processes(int target_pid);
+int follow_send(int fd, enum proc_cn_mcast_op op);
+int follow_connect(void);
+void set_process_comm(process_t *proc, const char *name);
+void reread_process(process_t *proc);
+void load_new_process(int pid);
+void follow_fork(struct proc_event *event);
+void follow_exit(struct proc_event *event);
+void apply_proc_event(struct proc_event *event);
+void follow_receive(void);
+int follow_processes(int target_pid);
+uint32_t snapshot_string(snapshot_strings_t *strings, const char *str);
+int save_snapshot(const char *path);
+int check_snapshot_links(const snapshot_record_t *records, uint32_t count, const uint32_t *children);
+int load_snapshot(const char *path);
+int identity_compare(const void *a, const void *b);
+int read_diff_side(const char *source, diff_side_t *side);
+void free_diff_side(diff_side_t *side);
+process_t *diff_node(process_t *source, int state);
+process_t *merged_parent(diff_side_t *side, process_t *proc);
+int build_diff_tree(diff_side_t *from, diff_side_t *to);
+void print_diff_marker(process_t *proc);
+int print_selection(int target_pid);
+int daemon_listen(const char *path);
+void daemon_order_table(void);
+int send_all(int fd, const char *data, size_t len);
+int daemon_read_request(int fd);
+void daemon_request(int client_fd);
+int daemon_serve(void);
+int query_daemon(int argc, char *argv[]);
+void print_usage(void);
+int parse_options(int argc, char *argv[], int *target_pid);
 
 // Check if string is a number (for PID directories)
 int is_number(const char *str) {
@@ -68,585 +686,4249 @@ int is_number(const char *str) {
     return 1;
 }
 
-// Read process information from /proc/[pid]
-int read_process_info(int pid, process_t *proc) {
-    char path[256];
-    FILE *file;
+// Allocate size bytes (8-byte aligned) from the arena
+void *arena_alloc(arena_t *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    
+    arena_chunk_t *chunk = arena->head;
+    if (!chunk || chunk->used + size > chunk->size) {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = malloc(sizeof(arena_chunk_t) + chunk_size);
+        if (!chunk) {
+            perror("malloc");
+            exit(1);
+        }
+        __atomic_add_fetch(&arena_chunk_count, 1, __ATOMIC_RELAXED);
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+    
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+// Copy len bytes of str into the arena as a NUL-terminated string
+char *arena_strndup(arena_t *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Move all chunks of other into arena, other is left empty
+void arena_adopt(arena_t *arena, arena_t *other) {
+    arena_chunk_t *tail = other->head;
+    if (!tail) {
+        return;
+    }
+    while (tail->next) {
+        tail = tail->next;
+    }
+    tail->next = arena->head;
+    arena->head = other->head;
+    other->head = NULL;
+}
+
+// Release every chunk of the arena
+void arena_free(arena_t *arena) {
+    arena_chunk_t *chunk = arena->head;
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+}
+
+// FNV-1a string hash
+unsigned int string_hash(const char *str) {
+    unsigned int hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Return the canonical copy of str, adding it to the table if needed
+const char *intern(intern_table_t *table, const char *str) {
+    if (!table->slots || table->count * 2 >= (int)(table->mask + 1)) {
+        // Grow to keep the load factor under 1/2
+        unsigned int capacity = table->slots ? (table->mask + 1) * 2 : 256;
+        const char **slots = calloc(capacity, sizeof(const char *));
+        if (!slots) {
+            perror("calloc");
+            exit(1);
+        }
+        if (table->slots) {
+            for (unsigned int i = 0; i <= table->mask; i++) {
+                if (table->slots[i]) {
+                    unsigned int slot = string_hash(table->slots[i]) & (capacity - 1);
+                    while (slots[slot]) {
+                        slot = (slot + 1) & (capacity - 1);
+                    }
+                    slots[slot] = table->slots[i];
+                }
+            }
+            free(table->slots);
+        }
+        table->slots = slots;
+        table->mask = capacity - 1;
+    }
+    
+    unsigned int slot = string_hash(str) & table->mask;
+    while (table->slots[slot]) {
+        if (strcmp(table->slots[slot], str) == 0) {
+            return table->slots[slot];
+        }
+        slot = (slot + 1) & table->mask;
+    }
+    
+    table->slots[slot] = table->arena ? arena_strndup(table->arena, str, strlen(str)) : str;
+    table->count++;
+    return table->slots[slot];
+}
+
+// Release the table itself, the strings belong to its arena
+void intern_free(intern_table_t *table) {
+    free(table->slots);
+    table->slots = NULL;
+    table->mask = 0;
+    table->count = 0;
+}
+
+// Allocate a zeroed process record from the arena
+process_t *alloc_process(arena_t *arena) {
+    process_t *proc = arena_alloc(arena, sizeof(process_t));
+    if (options.stats) {
+        __atomic_add_fetch(&io_counts.records, 1, __ATOMIC_RELAXED);
+    }
+    memset(proc, 0, sizeof(process_t));
+    proc->cmdline = "";
+    return proc;
+}
+
+// Allocate a record for a scanner, reusing a recycled one if there is any
+process_t *job_alloc_process(scan_job_t *job) {
+    process_t *proc = job->recycled;
+    if (!proc) {
+        return alloc_process(&job->arena);
+    }
+    job->recycled = proc->parent;
+    memset(proc, 0, sizeof(process_t));
+    proc->cmdline = "";
+    return proc;
+}
+
+// Record syscalls made to fetch a field (for --stats)
+void count_syscalls(int field, int count) {
+    if (options.stats) {
+        __atomic_add_fetch(&syscall_counts[field], count, __ATOMIC_RELAXED);
+    }
+}
+
+// Record files opened and bytes read (for --stats)
+void count_io(int files, ssize_t bytes) {
+    if (options.stats) {
+        if (files) {
+            __atomic_add_fetch(&io_counts.files_opened, files, __ATOMIC_RELAXED);
+        }
+        if (bytes > 0) {
+            __atomic_add_fetch(&io_counts.bytes_read, bytes, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Work out which fields the chosen options actually display
+void compute_needed_fields(void) {
+    needed_fields = 1u << FIELD_STAT;
+    if (options.save_file || options.daemon) {
+        // A snapshot or the daemon has to support every display option
+        needed_fields = (1u << FIELD_COUNT) - 1;
+        return;
+    }
+    if (options.uid_changes || options.user || options.format != FORMAT_TEXT) {
+        needed_fields |= 1u << FIELD_UID;
+    }
+    if (options.show_args) {
+        needed_fields |= 1u << FIELD_CMDLINE;
+    }
+    if (options.show_threads) {
+        needed_fields |= 1u << FIELD_THREADS;
+    }
+}
+
+// Current monotonic time in milliseconds
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Start timing a phase. A phase begun inside another (sorting while
+// building the tree) pauses the outer one, so every millisecond is
+// counted in exactly one phase.
+void phase_begin(int phase) {
+    double now = now_ms();
+    if (phase_depth > 0) {
+        phase_ms[phase_stack[phase_depth - 1]] += now - phase_started;
+    }
+    phase_stack[phase_depth++] = phase;
+    phase_started = now;
+}
+
+// Stop timing the innermost phase and resume the one around it
+void phase_end(void) {
+    double now = now_ms();
+    phase_ms[phase_stack[--phase_depth]] += now - phase_started;
+    phase_started = now;
+}
+
+// Print --stats as one line of key=value pairs on stderr: what was read,
+// the work it took, and where the time went
+void print_stats(void) {
+    int process_total = 0;
+    long thread_total = 0;
+    for (int i = 0; i < process_count; i++) {
+        if (!processes[i]->is_thread) {
+            process_total++;
+            thread_total += processes[i]->thread_count + 1;
+        }
+    }
+    
+    fprintf(stderr, "pstree-stats processes=%d threads=%ld scan.backend=%s",
+            process_total, thread_total, scan_backend);
+    fprintf(stderr, " files.opened=%lu bytes.read=%lu alloc.records=%lu alloc.chunks=%lu",
+            io_counts.files_opened, io_counts.bytes_read, io_counts.records, arena_chunk_count);
+    fprintf(stderr, " uring.sqes=%lu", io_counts.uring_sqes);
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        fprintf(stderr, " syscalls.%s=%lu", field_names[i], syscall_counts[i]);
+    }
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        fprintf(stderr, " time.%s_ms=%.3f", phase_names[i], phase_ms[i]);
+    }
+    fprintf(stderr, " time.total_ms=%.3f", now_ms() - run_started);
+    fprintf(stderr, " print.lines=%lu print.bytes=%lu print.lines_per_sec=%.0f", output.lines,
+            output.bytes_written + output.len,
+            phase_ms[PHASE_PRINT] > 0 ? output.lines * 1000.0 / phase_ms[PHASE_PRINT] : 0.0);
+    fprintf(stderr, "\n");
+}
+
+// Read a small file relative to dirfd into buf with a single read(),
+// NUL-terminated. Returns the number of bytes read or -1.
+ssize_t read_file_at(int dirfd, const char *name, char *buf, size_t size, int field) {
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        count_syscalls(field, 1);
+        return -1;
+    }
+    
+    ssize_t len = read(fd, buf, size - 1);
+    close(fd);
+    count_syscalls(field, 3);
+    count_io(1, len);
+    if (len < 0) {
+        return -1;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+// Parse the contents of /proc/[pid]/stat. comm may itself contain spaces
+// and parentheses, so it runs from the first '(' to the last ')'.
+int parse_stat(char *buf, process_t *proc, char *comm) {
+    char *open_paren = strchr(buf, '(');
+    char *close_paren = strrchr(buf, ')');
+    if (!open_paren || !close_paren || close_paren < open_paren) {
+        return -1;
+    }
+    
+    char *end;
+    proc->pid = (int)strtol(buf, &end, 10);
+    if (end == buf) {
+        return -1;
+    }
+    
+    size_t comm_len = close_paren - open_paren - 1;
+    if (comm_len > MAX_COMM - 1) {
+        comm_len = MAX_COMM - 1;
+    }
+    memcpy(comm, open_paren + 1, comm_len);
+    comm[comm_len] = '\0';
+    
+    // Remaining fields are space separated, numbered as in proc(5):
+    // (3) state (4) ppid (5) pgrp ... (14) utime (15) stime ... (20) num_threads
+    // (22) starttime (24) rss
+    char *cursor = close_paren + 1;
+    int field = 3;
+    int have_ppid = 0;
+    while (field <= 24) {
+        while (*cursor == ' ') {
+            cursor++;
+        }
+        if (*cursor == '\0' || *cursor == '\n') {
+            break;
+        }
+        
+        long long value = strtoll(cursor, &end, 10);
+        switch (field) {
+            case 4:
+                proc->ppid = (int)value;
+                have_ppid = (end != cursor);
+                break;
+            case 5:
+                proc->pgid = (int)value;
+                break;
+            case 14:
+                proc->utime = (unsigned long long)value;
+                break;
+            case 15:
+                proc->stime = (unsigned long long)value;
+                break;
+            case 20:
+                // num_threads includes the main thread
+                proc->thread_count = value > 1 ? (int)value - 1 : 0;
+                break;
+            case 22:
+                proc->starttime = (unsigned long long)value;
+                break;
+            case 24:
+                // Kernel threads report 0, never negative in practice
+                proc->rss = value > 0 ? (unsigned long long)value : 0;
+                break;
+        }
+        
+        // Skip to the end of this field
+        while (*cursor && *cursor != ' ' && *cursor != '\n') {
+            cursor++;
+        }
+        field++;
+    }
+    
+    return have_ppid ? 0 : -1;
+}
+
+// Add one {name} record per thread (other than the main thread) of proc,
+// read from /proc/[pid]/task/[tid]/comm. Only used for -t.
+void load_threads(int pid_fd, process_t *proc, scan_job_t *job) {
+    int task_fd = openat(pid_fd, "task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    count_syscalls(FIELD_THREADS, 1);
+    if (task_fd < 0) {
+        return;
+    }
+    count_io(1, 0);
+    
+    DIR *task_dir = fdopendir(task_fd);
+    if (!task_dir) {
+        close(task_fd);
+        return;
+    }
+    // fdopendir's fstat/fcntl, getdents until the empty read, and closedir
+    count_syscalls(FIELD_THREADS, 5);
+    
+    struct dirent *task_entry;
+    while ((task_entry = readdir(task_dir)) != NULL) {
+        if (!is_number(task_entry->d_name)) {
+            continue;
+        }
+        int tid = atoi(task_entry->d_name);
+        if (tid == proc->pid) {  // The main thread is the process itself
+            continue;
+        }
+        
+        char path[64];
+        char name[MAX_COMM - 2];  // Room for the braces
+        snprintf(path, sizeof(path), "%d/comm", tid);
+        ssize_t len = read_file_at(task_fd, path, name, sizeof(name), FIELD_THREADS);
+        if (len <= 0) {
+            continue;  // Thread exited while we were listing
+        }
+        if (name[len - 1] == '\n') {
+            name[len - 1] = '\0';
+        }
+        
+        char braced[MAX_COMM];
+        snprintf(braced, sizeof(braced), "{%s}", name);
+        
+        process_t *thread = job_alloc_process(job);
+        thread->pid = tid;
+        thread->ppid = proc->pid;
+        thread->uid = proc->uid;
+        thread->pgid = proc->pgid;
+        thread->is_thread = 1;
+        thread->comm = intern(&job->names, braced);
+        job_append(job, thread);
+    }
+    closedir(task_dir);
+}
+
+// Fill in proc from the contents of /proc/[pid]/stat. Everything but the
+// uid and the command line comes from there.
+int parse_process_info(char *stat, int pid, process_t *proc, scan_job_t *job) {
+    char comm[MAX_COMM];
     
     proc->pid = pid;
     proc->children = NULL;
     proc->child_count = 0;
-    proc->child_capacity = 0;
     proc->pgid = -1;
     proc->thread_count = 0;
     proc->is_thread = 0;
+    proc->utime = 0;
+    proc->stime = 0;
+    proc->rss = 0;
     
-    // Read from /proc/[pid]/stat
-    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
-    file = fopen(path, "r");
-    if (!file) {
+    // The thread count, CPU time and RSS come from stat as well
+    if (parse_stat(stat, proc, comm) != 0) {
         return -1;
     }
     
-    char state;
-    int tty_nr, session;
-    if (fscanf(file, "%d %s %c %d %d %d %d", 
-               &proc->pid, proc->comm, &state, &proc->ppid, 
-               &proc->pgid, &session, &tty_nr) < 4) {
-        fclose(file);
+    // Check if this is a thread (name starts with { and ends with })
+    if (comm[0] == '{' && comm[strlen(comm) - 1] == '}') {
+        proc->is_thread = 1;
+        // Remove the braces for comparison
+        comm[strlen(comm) - 1] = '\0';
+        memmove(comm, comm + 1, strlen(comm));
+    }
+    proc->comm = intern(&job->names, comm);
+    proc->uid = -1;
+    
+    // The command line is only read for processes that get printed
+    proc->cmdline = NULL;
+    return 0;
+}
+
+// Read process information from /proc/[pid]. All files are opened relative
+// to pid_fd, the directory fd for the PID, and read into one reusable buffer.
+int read_process_info(int pid_fd, int pid, process_t *proc, scan_job_t *job) {
+    char buf[4096];
+    if (read_file_at(pid_fd, "stat", buf, sizeof(buf), FIELD_STAT) <= 0 ||
+        parse_process_info(buf, pid, proc, job) != 0) {
         return -1;
     }
-    fclose(file);
     
-    // Remove parentheses from comm
-    if (proc->comm[0] == '(' && proc->comm[strlen(proc->comm) - 1] == ')') {
-        proc->comm[strlen(proc->comm) - 1] = '\0';
-        memmove(proc->comm, proc->comm + 1, strlen(proc->comm));
+    // The owner of /proc/[pid] is the process's uid, no need to parse status
+    if (needed_fields & (1u << FIELD_UID)) {
+        struct stat st;
+        count_syscalls(FIELD_UID, 1);
+        if (fstat(pid_fd, &st) == 0) {
+            proc->uid = (int)st.st_uid;
+        }
+    }
+    return 0;
+}
+
+// Command line of a process, read from /proc/[pid]/cmdline the first time
+// it is needed and kept in the arena at its actual length. Without -l it
+// is cut at MAX_CMDLINE bytes, "" when it cannot be read. --watch and
+// --daemon records outlive their processes, so there the string is owned
+// by the record instead and freed with it.
+const char *proc_cmdline(process_t *proc) {
+    if (proc->cmdline) {
+        return proc->cmdline;
     }
+    proc->cmdline = "";
     
-    // Check if this is a thread (name starts with { and ends with })
-    if (proc->comm[0] == '{' && proc->comm[strlen(proc->comm) - 1] == '}') {
-        proc->is_thread = 1;
-        // Remove the braces for comparison
-        proc->comm[strlen(proc->comm) - 1] = '\0';
-        memmove(proc->comm, proc->comm + 1, strlen(proc->comm));
+    char path[32];
+    snprintf(path, sizeof(path), "%d/cmdline", proc->pid);
+    int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+    count_syscalls(FIELD_CMDLINE, 1);
+    if (fd < 0) {
+        return proc->cmdline;
     }
+    count_io(1, 0);
     
-    // Read UID from /proc/[pid]/status
-    snprintf(path, sizeof(path), "/proc/%d/status", pid);
-    file = fopen(path, "r");
-    proc->uid = -1;
-    if (file) {
-        char line[256];
-        while (fgets(line, sizeof(line), file)) {
-            if (strncmp(line, "Uid:", 4) == 0) {
-                sscanf(line, "Uid:\t%d", &proc->uid);
-                break;
-            }
+    // One read normally returns all of it; a short read means the end
+    char stack_buf[MAX_CMDLINE];
+    char *buf = stack_buf;
+    size_t capacity = MAX_CMDLINE - 1;
+    size_t len = 0;
+    for (;;) {
+        ssize_t n = read(fd, buf + len, capacity - len);
+        count_syscalls(FIELD_CMDLINE, 1);
+        count_io(0, n);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        if (len < capacity) {
+            break;
         }
-        fclose(file);
+        if (!options.long_format) {
+            break;
+        }
+        
+        // -l: keep reading into a buffer twice the size
+        capacity *= 2;
+        char *bigger = buf == stack_buf ? malloc(capacity) : realloc(buf, capacity);
+        if (!bigger) {
+            perror("malloc");
+            exit(1);
+        }
+        if (buf == stack_buf) {
+            memcpy(bigger, stack_buf, len);
+        }
+        buf = bigger;
     }
+    close(fd);
+    count_syscalls(FIELD_CMDLINE, 1);
     
-    // Read cmdline if needed
-    proc->cmdline[0] = '\0';
-    if (options.show_args) {
-        snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
-        file = fopen(path, "r");
-        if (file) {
-            int i = 0;
-            int c;
-            while ((c = fgetc(file)) != EOF && i < MAX_CMDLINE - 1) {
-                if (c == '\0') {
-                    proc->cmdline[i++] = ' ';
-                } else {
-                    proc->cmdline[i++] = c;
-                }
-            }
-            proc->cmdline[i] = '\0';
-            
-            // Remove trailing space
-            if (i > 0 && proc->cmdline[i-1] == ' ') {
-                proc->cmdline[i-1] = '\0';
-            }
-            fclose(file);
+    // Arguments are NUL-separated, show them separated by spaces
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == '\0') {
+            buf[i] = ' ';
         }
     }
-    
-    return 0;
+    if (len > 0 && buf[len - 1] == ' ') {
+        len--;
+    }
+    if (len > 0 && (options.watch_interval > 0 || options.daemon)) {
+        free(proc->cmdline_buffer);  // Read before an exec
+        proc->cmdline_buffer = malloc(len + 1);
+        if (!proc->cmdline_buffer) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(proc->cmdline_buffer, buf, len);
+        proc->cmdline_buffer[len] = '\0';
+        proc->cmdline = proc->cmdline_buffer;
+    } else if (len > 0) {
+        proc->cmdline = arena_strndup(&process_arena, buf, len);
+    }
+    if (buf != stack_buf) {
+        free(buf);
+    }
+    return proc->cmdline;
 }
 
-// Scan all processes in /proc
-void scan_processes(void) {
-    DIR *proc_dir = opendir("/proc");
+// List the PID directories of the proc root. Returns the number of entries
+// and stores a malloc'd array in *list, in readdir order.
+int read_pid_list(pid_entry_t **list) {
+    DIR *proc_dir = opendir(options.proc_root);
     if (!proc_dir) {
-        perror("opendir /proc");
+        perror(options.proc_root);
         exit(1);
     }
     
+    pid_entry_t *pids = NULL;
+    int pid_count = 0;
+    int pid_capacity = 0;
     struct dirent *entry;
     while ((entry = readdir(proc_dir)) != NULL) {
         if (!is_number(entry->d_name)) {
             continue;
         }
         
-        int pid = atoi(entry->d_name);
-        process_t *proc = malloc(sizeof(process_t));
-        if (!proc) {
-            perror("malloc");
-            exit(1);
-        }
-        
-        if (read_process_info(pid, proc) == 0) {
-            processes[process_count++] = proc;
-            
-            // Scan for threads in /proc/[pid]/task/ - only if we want to show thread counts
-            char task_dir[256];
-            snprintf(task_dir, sizeof(task_dir), "/proc/%d/task", pid);
-            DIR *task_dir_ptr = opendir(task_dir);
-            if (task_dir_ptr) {
-                struct dirent *task_entry;
-                int thread_count = 0;
-                while ((task_entry = readdir(task_dir_ptr)) != NULL) {
-                    if (is_number(task_entry->d_name)) {
-                        int tid = atoi(task_entry->d_name);
-                        if (tid != pid) {  // Don't count the main thread
-                            thread_count++;
-                        }
-                    }
-                }
-                proc->thread_count = thread_count;
-                closedir(task_dir_ptr);
-            } else {
-                proc->thread_count = 0;
+        if (pid_count >= pid_capacity) {
+            pid_capacity = pid_capacity ? pid_capacity * 2 : 1024;
+            pids = realloc(pids, pid_capacity * sizeof(pid_entry_t));
+            if (!pids) {
+                perror("realloc");
+                exit(1);
             }
-        } else {
-            free(proc);
-        }
-        
-        if (process_count >= MAX_PROCESSES) {
-            break;
         }
+        pids[pid_count].pid = atoi(entry->d_name);
+        pids[pid_count].starttime = 0;
+        pid_count++;
     }
-    
     closedir(proc_dir);
+    
+    *list = pids;
+    return pid_count;
 }
 
-// Add child to parent process
-void add_child(process_t *parent, process_t *child) {
-    if (parent->child_count >= parent->child_capacity) {
-        parent->child_capacity = parent->child_capacity ? parent->child_capacity * 2 : 4;
-        parent->children = realloc(parent->children, 
-                                 parent->child_capacity * sizeof(process_t *));
-        if (!parent->children) {
+// Append a PID to a growable PID list
+void pid_list_append(pid_entry_t **list, int *count, int *capacity, int pid) {
+    if (*count >= *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 256;
+        *list = realloc(*list, *capacity * sizeof(pid_entry_t));
+        if (!*list) {
             perror("realloc");
             exit(1);
         }
     }
-    parent->children[parent->child_count++] = child;
+    (*list)[*count].pid = pid;
+    (*list)[*count].starttime = 0;
+    (*count)++;
 }
 
-// Build the process tree
-void build_process_tree(void) {
-    // Sort processes by PID if numeric sort is enabled
-    if (options.numeric_sort) {
-        qsort(processes, process_count, sizeof(process_t *), process_compare);
+// Append the PIDs in [tid]/children (relative to a task directory) to the
+// list. The file holds "pid pid ... " and is read in chunks since a
+// process can have any number of children. Returns -1 if it cannot be read.
+int read_children(int task_fd, const char *tid, pid_entry_t **list, int *count, int *capacity) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s/children", tid);
+    int fd = openat(task_fd, path, O_RDONLY | O_CLOEXEC);
+    count_syscalls(FIELD_STAT, 1);
+    if (fd < 0) {
+        return -1;
     }
+    count_io(1, 0);
     
-    // Build parent-child relationships
-    for (int i = 0; i < process_count; i++) {
-        process_t *child = processes[i];
-        
-        // Find parent
-        for (int j = 0; j < process_count; j++) {
-            process_t *parent = processes[j];
-            if (parent->pid == child->ppid) {
-                add_child(parent, child);
-                break;
+    char buf[4096];
+    int pid = 0;
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        count_syscalls(FIELD_STAT, 1);
+        count_io(0, len);
+        for (ssize_t i = 0; i < len; i++) {
+            if (buf[i] >= '0' && buf[i] <= '9') {
+                pid = pid * 10 + (buf[i] - '0');
+            } else if (pid > 0) {
+                pid_list_append(list, count, capacity, pid);
+                pid = 0;
             }
         }
     }
+    if (pid > 0) {
+        pid_list_append(list, count, capacity, pid);
+    }
+    close(fd);
+    count_syscalls(FIELD_STAT, 2);  // Final read and close
+    return 0;
+}
+
+// List root_pid and all its descendants breadth-first by following the
+// children files of every task, so only the subtree is visited. Returns
+// the number of PIDs, or -1 when the kernel has no children files
+// (CONFIG_PROC_CHILDREN) or root_pid does not exist.
+int read_subtree_pids(int root_pid, pid_entry_t **list) {
+    pid_entry_t *pids = NULL;
+    int pid_count = 0;
+    int pid_capacity = 0;
+    pid_list_append(&pids, &pid_count, &pid_capacity, root_pid);
     
-    // Sort children of each process
-    for (int i = 0; i < process_count; i++) {
-        if (processes[i]->child_count > 0) {
-            qsort(processes[i]->children, processes[i]->child_count,
-                  sizeof(process_t *), process_compare);
+    // Children are forked by any thread, each task lists its own
+    for (int i = 0; i < pid_count; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "%d/task", pids[i].pid);
+        int task_fd = openat(proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        count_syscalls(FIELD_STAT, 1);
+        count_io(task_fd >= 0, 0);
+        DIR *task_dir = task_fd >= 0 ? fdopendir(task_fd) : NULL;
+        if (!task_dir) {
+            if (task_fd >= 0) {
+                close(task_fd);
+            }
+            if (i == 0) {
+                free(pids);
+                return -1;
+            }
+            continue;  // Exited while we were walking the tree
+        }
+        count_syscalls(FIELD_STAT, 5);
+        
+        struct dirent *entry;
+        int readable = 0;
+        while ((entry = readdir(task_dir)) != NULL) {
+            if (is_number(entry->d_name) &&
+                read_children(task_fd, entry->d_name, &pids, &pid_count, &pid_capacity) == 0) {
+                readable = 1;
+            }
+        }
+        closedir(task_dir);
+        
+        if (i == 0 && !readable) {
+            free(pids);
+            return -1;
         }
     }
+    
+    // A full scan reads /proc in PID order, keep equally named siblings
+    // in the same order
+    qsort(pids, pid_count, sizeof(pid_entry_t), pid_entry_compare);
+    *list = pids;
+    return pid_count;
 }
 
-// Compare processes for sorting
-int process_compare(const void *a, const void *b) {
-    process_t *proc_a = *(process_t **)a;
-    process_t *proc_b = *(process_t **)b;
+// Scan all processes in /proc
+void scan_processes(void) {
+    if (proc_fd < 0) {
+        proc_fd = open(options.proc_root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (proc_fd < 0) {
+            perror(options.proc_root);
+            exit(1);
+        }
+    }
     
-    if (options.numeric_sort) {
-        return proc_a->pid - proc_b->pid;
+    // Collect the PID directories first so they can be split between
+    // workers: only the requested subtree when the kernel can list it
+    pid_entry_t *pids = NULL;
+    int pid_count = -1;
+    if (options.subtree_pid > 0) {
+        pid_count = read_subtree_pids(options.subtree_pid, &pids);
+    }
+    if (pid_count < 0) {
+        options.subtree_pid = 0;
+        pid_count = read_pid_list(&pids);
+    }
+    
+    reserve_processes(estimate_table_size(pid_count));
+    scan_backend = "sync";
+    scan_parallel(pids, pid_count, options.jobs > 1 ? options.jobs : 1);
+    
+    // -u compares the root's owner with its parent's, which is outside
+    // the subtree
+    if (options.subtree_pid > 0 && options.uid_changes) {
+        for (int i = 0; i < process_count; i++) {
+            if (processes[i]->pid == options.subtree_pid && processes[i]->ppid > 0) {
+                pid_entry_t parent = {processes[i]->ppid, 0};
+                scan_parallel(&parent, 1, 1);
+                break;
+            }
+        }
+    }
+    
+    // --watch and --daemon diff later listings against this one
+    if (options.watch_interval > 0 || options.daemon) {
+        watch.pids = pids;
+        watch.pid_count = pid_count;
     } else {
-        return strcmp(proc_a->comm, proc_b->comm);
+        free(pids);
+    }
+    
+    build_pid_index();
+    for (int i = 0; i < watch.pid_count; i++) {
+        process_t *proc = find_process(watch.pids[i].pid);
+        watch.pids[i].starttime = proc ? proc->starttime : 0;
     }
 }
 
-// Print the process tree
-void print_tree(process_t *proc, const char *prefix, int is_last) {
-    if (!proc) return;
+// Make room for at least capacity records in the process table
+void reserve_processes(int capacity) {
+    if (capacity <= process_capacity) {
+        return;
+    }
     
-    // Print current process
-    printf("%s", prefix);
+    int new_capacity = process_capacity ? process_capacity : 1024;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+    processes = realloc(processes, new_capacity * sizeof(process_t *));
+    if (!processes) {
+        perror("realloc");
+        exit(1);
+    }
+    process_capacity = new_capacity;
+}
+
+// Add a record to the end of the process table
+void table_append(process_t *proc) {
+    if (process_count >= process_capacity) {
+        reserve_processes(process_count + 1);
+    }
+    proc->table_index = process_count;
+    processes[process_count++] = proc;
+}
+
+// Expected number of table entries: the PID directories found, or with -t
+// the number of tasks (processes and threads) from /proc/loadavg
+int estimate_table_size(int pid_count) {
+    if (!(needed_fields & (1u << FIELD_THREADS)) || options.subtree_pid > 0) {
+        return pid_count;
+    }
     
-    // Choose the appropriate tree characters
-    const char *branch, *continue_prefix;
-    if (options.ascii_mode) {
-        branch = is_last ? "`-" : "|-";
-        continue_prefix = is_last ? "  " : "| ";
+    char buf[128];
+    int running, tasks;
+    if (read_file_at(proc_fd, "loadavg", buf, sizeof(buf), FIELD_STAT) > 0 &&
+        sscanf(buf, "%*f %*f %*f %d/%d", &running, &tasks) == 2 && tasks > pid_count) {
+        return tasks;
+    }
+    return pid_count;
+}
+
+// Append a record to a scanner's buffer
+void job_append(scan_job_t *job, process_t *proc) {
+    if (job->result_count >= job->result_capacity) {
+        job->result_capacity = job->result_capacity ? job->result_capacity * 2 : 256;
+        job->results = realloc(job->results, job->result_capacity * sizeof(process_t *));
+        if (!job->results) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    job->results[job->result_count++] = proc;
+}
+
+// Read one process (and its threads for -t) into a scanner's buffer.
+// Processes that vanished or cannot be read are skipped.
+void load_process(int pid, scan_job_t *job) {
+    char name[16];
+    snprintf(name, sizeof(name), "%d", pid);
+    int pid_fd = openat(proc_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    count_syscalls(FIELD_STAT, 1);
+    if (pid_fd < 0) {
+        return;
+    }
+    count_io(1, 0);
+    
+    // A record for a process that vanished is simply abandoned in the arena
+    process_t *proc = job_alloc_process(job);
+    if (read_process_info(pid_fd, pid, proc, job) != 0) {
+        close(pid_fd);
+        count_syscalls(FIELD_STAT, 1);
+        proc->parent = job->recycled;
+        job->recycled = proc;
+        return;
+    }
+    job_append(job, proc);
+    
+    // Thread counts come from stat; the task directory is only walked
+    // when the thread names are going to be shown
+    if (needed_fields & (1u << FIELD_THREADS)) {
+        load_threads(pid_fd, proc, job);
+    }
+    close(pid_fd);
+    count_syscalls(FIELD_STAT, 1);
+}
+
+// Worker thread: read a contiguous slice of the PID list into its own buffer
+void *scan_worker(void *arg) {
+    scan_job_t *job = arg;
+    
+    if (options.io_uring && uring_scan(job) == 0) {
+        job->used_uring = 1;
+        return NULL;
+    }
+    for (int i = 0; i < job->count; i++) {
+        load_process(job->pids[i].pid, job);
+    }
+    return NULL;
+}
+
+// Create a ring with room for entries SQEs and map it. Returns 0, or -1
+// when io_uring is unavailable (old kernel, seccomp, io_uring_disabled).
+int uring_setup(uring_t *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    count_syscalls(FIELD_STAT, 1);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    
+    // Reading a direct descriptor opened earlier in the same link needs
+    // the file to be looked up when the read runs, not when it is queued
+    if (!(params.features & IORING_FEAT_LINKED_FILE)) {
+        uring_free(ring);
+        return -1;
+    }
+    
+    ring->ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) && ring->cq_size > ring->ring_size) {
+        ring->ring_size = ring->cq_size;
+    }
+    ring->ring_map = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    count_syscalls(FIELD_STAT, 1);
+    if (ring->ring_map == MAP_FAILED) {
+        ring->ring_map = NULL;
+        uring_free(ring);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->ring_map;
     } else {
-        branch = is_last ? "└─" : "├─";
-        continue_prefix = is_last ? "  " : "│ ";
+        ring->cq_map = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        count_syscalls(FIELD_STAT, 1);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            uring_free(ring);
+            return -1;
+        }
+    }
+    ring->sqe_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqe_map = mmap(NULL, ring->sqe_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    count_syscalls(FIELD_STAT, 1);
+    if (ring->sqe_map == MAP_FAILED) {
+        ring->sqe_map = NULL;
+        uring_free(ring);
+        return -1;
     }
     
-    printf("%s", branch);
+    char *sq = ring->ring_map;
+    char *cq = ring->cq_map;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sqes = ring->sqe_map;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
     
-    // Check if this process should be highlighted
-    int highlight = should_highlight(proc);
-    if (highlight) {
-        printf("\033[1m"); // Bold text
+    // An empty table of direct descriptors, one per slot, so files never
+    // enter the process's fd table
+    int files[URING_SLOTS];
+    for (int i = 0; i < URING_SLOTS; i++) {
+        files[i] = -1;
+    }
+    count_syscalls(FIELD_STAT, 1);
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, files, URING_SLOTS) < 0) {
+        uring_free(ring);
+        return -1;
+    }
+    return 0;
+}
+
+// Unmap and close a ring, also after a partial uring_setup
+void uring_free(uring_t *ring) {
+    if (ring->sqe_map) {
+        munmap(ring->sqe_map, ring->sqe_size);
+    }
+    if (ring->cq_map && ring->cq_map != ring->ring_map) {
+        munmap(ring->cq_map, ring->cq_size);
+    }
+    if (ring->ring_map) {
+        munmap(ring->ring_map, ring->ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Next free SQE, cleared and tagged with its slot and operation. The ring
+// is sized so that it never fills up.
+struct io_uring_sqe *uring_sqe(uring_t *ring, int opcode, int slot, int op) {
+    unsigned tail = *ring->sq_tail + ring->queued;
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = (uint64_t)slot * 4 + op;
+    ring->sq_array[index] = index;
+    ring->queued++;
+    return sqe;
+}
+
+// Submit the queued SQEs and wait for at least wait completions
+int uring_enter(uring_t *ring, unsigned wait) {
+    unsigned submit = ring->queued;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+    ring->queued = 0;
+    if (options.stats) {
+        __atomic_add_fetch(&io_counts.uring_sqes, submit, __ATOMIC_RELAXED);
+    }
+    
+    while (1) {
+        count_syscalls(FIELD_STAT, 1);
+        int ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+        submit = 0;  // The kernel consumed them before the signal arrived
+    }
+}
+
+// Queue the reads for job->pids[index] in a slot: openat of [pid]/stat
+// into the slot's direct descriptor, linked to the read and the close, and
+// a statx of the PID directory for the owner when the uid is needed
+void uring_start(uring_t *ring, uring_slot_t *slots, int slot, scan_job_t *job, int index) {
+    uring_slot_t *s = &slots[slot];
+    int pid = job->pids[index].pid;
+    s->index = index;
+    s->stat_len = -1;
+    s->statx.stx_uid = (uint32_t)-1;
+    snprintf(s->path, sizeof(s->path), "%d/stat", pid);
+    
+    struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_OPENAT, slot, URING_OPEN);
+    sqe->fd = proc_fd;
+    sqe->addr = (uintptr_t)s->path;
+    sqe->open_flags = O_RDONLY;  // Direct descriptors reject O_CLOEXEC
+    sqe->file_index = slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    
+    // A hard link so the close runs even when the read fails
+    sqe = uring_sqe(ring, IORING_OP_READ, slot, URING_READ);
+    sqe->fd = slot;
+    sqe->addr = (uintptr_t)s->stat;
+    sqe->len = sizeof(s->stat) - 1;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    
+    sqe = uring_sqe(ring, IORING_OP_CLOSE, slot, URING_CLOSE);
+    sqe->file_index = slot + 1;
+    s->pending = 3;
+    
+    if (needed_fields & (1u << FIELD_UID)) {
+        snprintf(s->dir, sizeof(s->dir), "%d", pid);
+        sqe = uring_sqe(ring, IORING_OP_STATX, slot, URING_STATX);
+        sqe->fd = proc_fd;
+        sqe->addr = (uintptr_t)s->dir;
+        sqe->len = STATX_UID;
+        sqe->off = (uintptr_t)&s->statx;
+        s->pending++;
+    }
+}
+
+// Read the job's PID list through io_uring with URING_SLOTS processes in
+// flight. Records are appended in PID list order, as load_process would.
+// Returns -1 without reading anything when the ring cannot be used, so the
+// caller falls back to the plain syscalls.
+int uring_scan(scan_job_t *job) {
+    uring_t ring;
+    if (job->count == 0 || uring_setup(&ring, URING_SLOTS * 4) != 0) {
+        return -1;
+    }
+    
+    uring_slot_t *slots = malloc(URING_SLOTS * sizeof(uring_slot_t));
+    process_t **found = calloc(job->count, sizeof(process_t *));
+    if (!slots || !found) {
+        perror("malloc");
+        exit(1);
+    }
+    
+    int next = 0;
+    int active = 0;
+    while (active < URING_SLOTS && next < job->count) {
+        uring_start(&ring, slots, active++, job, next++);
+    }
+    int failed = 0;
+    while (active > 0) {
+        if (uring_enter(&ring, 1) != 0) {
+            failed = 1;
+            break;
+        }
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+            int slot = cqe->user_data / 4;
+            int op = cqe->user_data % 4;
+            uring_slot_t *s = &slots[slot];
+            
+            if (op == URING_OPEN) {
+                count_io(cqe->res >= 0, 0);
+            } else if (op == URING_READ) {
+                s->stat_len = cqe->res;
+                count_io(0, cqe->res);
+            } else if (op == URING_STATX) {
+                if (cqe->res < 0) {
+                    s->statx.stx_uid = (uint32_t)-1;
+                }
+            }
+            if (--s->pending > 0) {
+                continue;
+            }
+            
+            // All completions for this PID are in
+            if (s->stat_len > 0) {
+                s->stat[s->stat_len] = '\0';
+                process_t *proc = job_alloc_process(job);
+                if (parse_process_info(s->stat, job->pids[s->index].pid, proc, job) == 0) {
+                    if (needed_fields & (1u << FIELD_UID)) {
+                        proc->uid = (int)s->statx.stx_uid;
+                    }
+                    found[s->index] = proc;
+                } else {
+                    proc->parent = job->recycled;
+                    job->recycled = proc;
+                }
+            }
+            if (next < job->count) {
+                uring_start(&ring, slots, slot, job, next++);
+            } else {
+                active--;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    uring_free(&ring);
+    count_syscalls(FIELD_STAT, 1);
+    if (!failed) {
+        // After a failed io_uring_enter the kernel may still be writing
+        // into requests in flight, so the slots are left alone
+        free(slots);
+    }
+    
+    for (int i = 0; i < job->count; i++) {
+        process_t *proc = found[i];
+        if (!proc) {
+            continue;
+        }
+        if (failed) {
+            proc->parent = job->recycled;
+            job->recycled = proc;
+            continue;
+        }
+        job_append(job, proc);
+        
+        // The task directory is only needed for processes with threads
+        if ((needed_fields & (1u << FIELD_THREADS)) && proc->thread_count > 0) {
+            char name[16];
+            snprintf(name, sizeof(name), "%d", proc->pid);
+            int pid_fd = openat(proc_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            count_syscalls(FIELD_STAT, 1);
+            if (pid_fd >= 0) {
+                count_io(1, 0);
+                load_threads(pid_fd, proc, job);
+                close(pid_fd);
+                count_syscalls(FIELD_STAT, 1);
+            }
+        }
+    }
+    free(found);
+    return failed ? -1 : 0;
+}
+
+// Read the PID list with a pool of worker threads (jobs == 1 reads it on the
+// calling thread). Each worker fills its own buffer; the buffers are merged
+// in slice order so the table ends up in the same order as a serial scan.
+void scan_parallel(pid_entry_t *pids, int pid_count, int jobs) {
+    if (jobs > pid_count) {
+        jobs = pid_count > 0 ? pid_count : 1;
+    }
+    
+    scan_job_t *workers = calloc(jobs, sizeof(scan_job_t));
+    if (!workers) {
+        perror("calloc");
+        exit(1);
+    }
+    
+    int per_worker = pid_count / jobs;
+    int remainder = pid_count % jobs;
+    int next = 0;
+    for (int i = 0; i < jobs; i++) {
+        workers[i].pids = pids + next;
+        workers[i].count = per_worker + (i < remainder ? 1 : 0);
+        workers[i].names.arena = &workers[i].arena;
+        workers[i].result_capacity = workers[i].count;
+        workers[i].results = malloc((workers[i].count ? workers[i].count : 1) *
+                                    sizeof(process_t *));
+        if (!workers[i].results) {
+            perror("malloc");
+            exit(1);
+        }
+        next += workers[i].count;
+        
+        if (jobs == 1 ||
+            pthread_create(&workers[i].thread, NULL, scan_worker, &workers[i]) != 0) {
+            // Could not start a thread, read this slice on the calling thread
+            workers[i].thread_started = 0;
+            scan_worker(&workers[i]);
+        } else {
+            workers[i].thread_started = 1;
+        }
+    }
+    
+    for (int i = 0; i < jobs; i++) {
+        if (workers[i].thread_started) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        if (workers[i].used_uring) {
+            scan_backend = "io_uring";  // Only set here, after the worker is done
+        }
+        
+        // Names are re-interned so equal names share one pointer across workers
+        reserve_processes(process_count + workers[i].result_count);
+        for (int j = 0; j < workers[i].result_count; j++) {
+            process_t *proc = workers[i].results[j];
+            proc->comm = intern(&comm_names, proc->comm);
+            table_append(proc);
+        }
+        free(workers[i].results);
+        intern_free(&workers[i].names);
+        arena_adopt(&process_arena, &workers[i].arena);
+    }
+    free(workers);
+}
+
+// Multiplicative hash, spreads sequential PIDs across the index
+unsigned int pid_hash(int pid) {
+    return (unsigned int)pid * 2654435761u;
+}
+
+// Build the PID index over the process table
+void build_pid_index(void) {
+    unsigned int capacity = 16;
+    while (capacity < (unsigned int)process_count * 2) {
+        capacity <<= 1;
+    }
+    
+    free(pid_index.slots);
+    pid_index.slots = calloc(capacity, sizeof(process_t *));
+    if (!pid_index.slots) {
+        perror("calloc");
+        exit(1);
+    }
+    pid_index.mask = capacity - 1;
+    
+    for (int i = 0; i < process_count; i++) {
+        unsigned int slot = pid_hash(processes[i]->pid) & pid_index.mask;
+        while (pid_index.slots[slot]) {
+            slot = (slot + 1) & pid_index.mask;
+        }
+        pid_index.slots[slot] = processes[i];
+    }
+}
+
+// Look up a process by PID, NULL if it is not in the table
+process_t *find_process(int pid) {
+    if (!pid_index.slots) {
+        return NULL;
+    }
+    
+    unsigned int slot = pid_hash(pid) & pid_index.mask;
+    while (pid_index.slots[slot]) {
+        if (pid_index.slots[slot]->pid == pid) {
+            return pid_index.slots[slot];
+        }
+        slot = (slot + 1) & pid_index.mask;
+    }
+    return NULL;
+}
+
+// Add a record that is already in the process table to the PID index,
+// rebuilding the index when it gets more than half full
+void pid_index_insert(process_t *proc) {
+    if (!pid_index.slots || (unsigned int)process_count * 2 > pid_index.mask + 1) {
+        build_pid_index();
+        return;
+    }
+    
+    unsigned int slot = pid_hash(proc->pid) & pid_index.mask;
+    while (pid_index.slots[slot]) {
+        slot = (slot + 1) & pid_index.mask;
+    }
+    pid_index.slots[slot] = proc;
+}
+
+// Remove a record from the PID index. Entries after it in the probe
+// sequence are shifted back so lookups never stop at the hole.
+void pid_index_remove(process_t *proc) {
+    if (!pid_index.slots) {
+        return;
+    }
+    
+    unsigned int hole = pid_hash(proc->pid) & pid_index.mask;
+    while (pid_index.slots[hole] != proc) {
+        if (!pid_index.slots[hole]) {
+            return;
+        }
+        hole = (hole + 1) & pid_index.mask;
+    }
+    
+    unsigned int slot = hole;
+    for (;;) {
+        slot = (slot + 1) & pid_index.mask;
+        process_t *entry = pid_index.slots[slot];
+        if (!entry) {
+            break;
+        }
+        // Move entry into the hole unless its home slot lies between
+        // the hole and its current slot
+        unsigned int home = pid_hash(entry->pid) & pid_index.mask;
+        if (((slot - home) & pid_index.mask) >= ((slot - hole) & pid_index.mask)) {
+            pid_index.slots[hole] = entry;
+            hole = slot;
+        }
+    }
+    pid_index.slots[hole] = NULL;
+}
+
+// Link every process of the table into the list of its uid, one pass
+// over the table
+void build_uid_index(void) {
+    unsigned int capacity = 16;
+    while (capacity < (unsigned int)process_count * 2) {
+        capacity <<= 1;
+    }
+    
+    free(uid_index.slots);
+    uid_index.slots = calloc(capacity, sizeof(process_t *));
+    if (!uid_index.slots) {
+        perror("calloc");
+        exit(1);
+    }
+    uid_index.mask = capacity - 1;
+    
+    for (int i = 0; i < process_count; i++) {
+        process_t *proc = processes[i];
+        unsigned int slot = pid_hash(proc->uid) & uid_index.mask;
+        while (uid_index.slots[slot] && uid_index.slots[slot]->uid != proc->uid) {
+            slot = (slot + 1) & uid_index.mask;
+        }
+        proc->next_by_uid = uid_index.slots[slot];
+        uid_index.slots[slot] = proc;
+    }
+}
+
+// Number of ancestors of proc
+int process_depth(process_t *proc) {
+    int depth = 0;
+    for (process_t *ancestor = proc->parent; ancestor; ancestor = ancestor->parent) {
+        depth++;
+    }
+    return depth;
+}
+
+// Order two processes, neither an ancestor of the other, as a depth-first
+// walk of the tree reaches them: compare the ancestors that are siblings
+int tree_order_compare(const void *a, const void *b) {
+    process_t *proc_a = *(process_t **)a;
+    process_t *proc_b = *(process_t **)b;
+    int depth_a = process_depth(proc_a);
+    int depth_b = process_depth(proc_b);
+    for (; depth_a > depth_b; depth_a--) {
+        proc_a = proc_a->parent;
+    }
+    for (; depth_b > depth_a; depth_b--) {
+        proc_b = proc_b->parent;
+    }
+    while (proc_a->parent != proc_b->parent) {
+        proc_a = proc_a->parent;
+        proc_b = proc_b->parent;
+    }
+    
+    return process_compare(&proc_a, &proc_b);
+}
+
+// Print every tree below top_pid whose root is owned by uid and has no
+// ancestor owned by uid, in tree order. Only the processes of uid are
+// visited, through uid_index, and the ancestors of each.
+void print_user_trees(int uid, int top_pid) {
+    process_t *first = NULL;
+    if (uid_index.slots) {
+        unsigned int slot = pid_hash(uid) & uid_index.mask;
+        while (uid_index.slots[slot] && uid_index.slots[slot]->uid != uid) {
+            slot = (slot + 1) & uid_index.mask;
+        }
+        first = uid_index.slots[slot];
+    }
+    
+    int count = 0;
+    for (process_t *proc = first; proc; proc = proc->next_by_uid) {
+        count++;
+    }
+    process_t **roots = malloc((count ? count : 1) * sizeof(process_t *));
+    if (!roots) {
+        perror("malloc");
+        exit(1);
+    }
+    
+    int root_count = 0;
+    for (process_t *proc = first; proc; proc = proc->next_by_uid) {
+        if (proc->is_thread) {
+            continue;
+        }
+        int is_root = 1;
+        int below_top = proc->pid == top_pid;
+        for (process_t *ancestor = proc->parent; ancestor; ancestor = ancestor->parent) {
+            if (ancestor->uid == uid) {
+                is_root = 0;
+                break;
+            }
+            if (ancestor->pid == top_pid) {
+                below_top = 1;
+            }
+        }
+        if (is_root && below_top) {
+            roots[root_count++] = proc;
+        }
+    }
+    
+    // --sort compares the roots through the totals of their ancestors, so
+    // work those out first, reordering copies as print_view() does
+    process_t *top = find_process(top_pid);
+    int totals = options.sort_key != SORT_NONE && top && root_count > 1;
+    if (totals) {
+        render_order_begin(top);
+        compute_subtree_totals(top);
+    }
+    qsort(roots, root_count, sizeof(process_t *), tree_order_compare);
+    if (totals) {
+        render_order_end();
+    }
+    for (int i = 0; i < root_count; i++) {
+        print_view(roots[i], roots[i]->pid);
+    }
+    free(roots);
+}
+
+// Print what the arguments select: the tree below target_pid or, with
+// USER, the trees of that user. Returns -1, without printing anything,
+// when target_pid does not exist.
+int print_selection(int target_pid) {
+    process_t *root = NULL;
+    if (options.user) {
+        if (!uid_index.slots) {
+            build_uid_index();
+        }
+    } else {
+        root = find_process(target_pid);
+        if (!root) {
+            return -1;
+        }
+    }
+    
+    if (options.format == FORMAT_JSON) {
+        out_write("[", 1);
+    }
+    if (options.user) {
+        print_user_trees(options.user_uid, target_pid);
+    } else {
+        print_view(root, target_pid);
+    }
+    if (options.format == FORMAT_JSON) {
+        out_write("]\n", 2);
+    }
+    return 0;
+}
+
+// Build the process tree
+void build_process_tree(void) {
+    // Sort processes by PID if numeric sort is enabled
+    if (options.numeric_sort) {
+        phase_begin(PHASE_SORT);
+        sort_processes(processes, process_count);
+        phase_end();
+    }
+    
+    // Link each process to its parent
+    for (int i = 0; i < process_count; i++) {
+        process_t *child = processes[i];
+        child->parent = find_process(child->ppid);
+        child->table_index = i;
+    }
+    link_children();
+}
+
+// Fill in the children arrays from the parent pointers of the table
+void link_children(void) {
+    int linked = 0;
+    for (int i = 0; i < process_count; i++) {
+        processes[i]->child_count = 0;
+        if (processes[i]->parent) {
+            linked++;
+        }
+    }
+    for (int i = 0; i < process_count; i++) {
+        if (processes[i]->parent) {
+            processes[i]->parent->child_count++;
+        }
+    }
+    
+    // Give every parent a slice of one contiguous children array
+    free(child_pool);
+    child_pool = malloc((linked ? linked : 1) * sizeof(process_t *));
+    if (!child_pool) {
+        perror("malloc");
+        exit(1);
+    }
+    int offset = 0;
+    for (int i = 0; i < process_count; i++) {
+        processes[i]->children = child_pool + offset;
+        offset += processes[i]->child_count;
+        processes[i]->child_count = 0;
+    }
+    for (int i = 0; i < process_count; i++) {
+        process_t *parent = processes[i]->parent;
+        if (parent) {
+            parent->children[parent->child_count++] = processes[i];
+        }
+    }
+    
+    sort_children();
+}
+
+// Sort the children of each process, timed as its own phase
+void sort_children(void) {
+    phase_begin(PHASE_SORT);
+    for (int i = 0; i < process_count; i++) {
+        sort_processes(processes[i]->children, processes[i]->child_count);
+    }
+    phase_end();
+}
+
+// Compare processes for sorting
+int process_compare(const void *a, const void *b) {
+    process_t *proc_a = *(process_t **)a;
+    process_t *proc_b = *(process_t **)b;
+    
+    // --sort puts the largest subtree first, ties keep the name or PID order
+    // and equal names are in PID order
+    if (options.sort_key != SORT_NONE) {
+        unsigned long long key_a = options.sort_key == SORT_RSS ? proc_a->total_rss : proc_a->total_cpu;
+        unsigned long long key_b = options.sort_key == SORT_RSS ? proc_b->total_rss : proc_b->total_cpu;
+        if (key_a != key_b) {
+            return key_a < key_b ? 1 : -1;
+        }
+    }
+    
+    if (!options.numeric_sort) {
+        int order = strcmp(proc_a->comm, proc_b->comm);
+        if (order != 0) {
+            return order;
+        }
+    }
+    return (proc_a->pid > proc_b->pid) - (proc_a->pid < proc_b->pid);
+}
+
+// Fill in the ordering key of proc for the current options, so that
+// child_key_compare() agrees with process_compare()
+void make_child_key(process_t *proc, child_key_t *key) {
+    key->rank = 0;
+    if (options.sort_key != SORT_NONE) {
+        key->rank = ~(options.sort_key == SORT_RSS ? proc->total_rss : proc->total_cpu);
+    }
+    key->proc = proc;
+    key->words[0] = 0;
+    key->words[1] = 0;
+    key->words[2] = (uint32_t)proc->pid ^ 0x80000000u;  // Signed order as unsigned
+    if (options.numeric_sort) {
+        return;
+    }
+    
+    // strcmp compares unsigned bytes up to the NUL, as do these words
+    const unsigned char *comm = (const unsigned char *)proc->comm;
+    for (int i = 0; i < 16 && comm[i]; i++) {
+        key->words[i / 8] |= (uint64_t)comm[i] << (56 - 8 * (i % 8));
+    }
+}
+
+// Compare two precomputed keys the way process_compare() compares their
+// processes
+int child_key_compare(const child_key_t *a, const child_key_t *b) {
+    if (a->rank != b->rank) {
+        return a->rank < b->rank ? -1 : 1;
+    }
+    if (a->words[0] != b->words[0]) {
+        return a->words[0] < b->words[0] ? -1 : 1;
+    }
+    if (a->words[1] != b->words[1]) {
+        return a->words[1] < b->words[1] ? -1 : 1;
+    }
+    
+    // Equal 16-byte prefixes only differ if neither name ended within them
+    if ((a->words[1] & 0xff) && a->proc->comm != b->proc->comm) {
+        int order = strcmp(a->proc->comm + 16, b->proc->comm + 16);
+        if (order != 0) {
+            return order;
+        }
+    }
+    if (a->words[2] != b->words[2]) {
+        return a->words[2] < b->words[2] ? -1 : 1;
+    }
+    return 0;
+}
+
+// Stable insertion sort, for short arrays and the runs of merge_sort_keys()
+void insertion_sort_keys(child_key_t *keys, int count) {
+    for (int i = 1; i < count; i++) {
+        child_key_t key = keys[i];
+        int j = i;
+        while (j > 0 && child_key_compare(&keys[j - 1], &key) > 0) {
+            keys[j] = keys[j - 1];
+            j--;
+        }
+        keys[j] = key;
+    }
+}
+
+// Stable bottom-up merge sort: insertion-sorted runs, then merges that
+// alternate between keys and scratch
+void merge_sort_keys(child_key_t *keys, child_key_t *scratch, int count) {
+    for (int start = 0; start < count; start += SORT_INSERTION_MAX) {
+        int run = count - start < SORT_INSERTION_MAX ? count - start : SORT_INSERTION_MAX;
+        insertion_sort_keys(keys + start, run);
+    }
+    
+    child_key_t *from = keys;
+    child_key_t *to = scratch;
+    for (int width = SORT_INSERTION_MAX; width < count; width *= 2) {
+        for (int start = 0; start < count; start += 2 * width) {
+            int mid = start + width < count ? start + width : count;
+            int end = start + 2 * width < count ? start + 2 * width : count;
+            int left = start, right = mid, out = start;
+            while (left < mid && right < end) {
+                // Take from the left on ties to keep the sort stable
+                if (child_key_compare(&from[right], &from[left]) < 0) {
+                    to[out++] = from[right++];
+                } else {
+                    to[out++] = from[left++];
+                }
+            }
+            memcpy(to + out, from + left, (mid - left) * sizeof(child_key_t));
+            out += mid - left;
+            memcpy(to + out, from + right, (end - right) * sizeof(child_key_t));
+        }
+        child_key_t *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != keys) {
+        memcpy(keys, from, count * sizeof(child_key_t));
+    }
+}
+
+// Stable LSD radix sort on the key words, one byte per pass from the PID
+// up to the first byte of the name. Bytes every key shares (the "kworker/"
+// of kworker names, the upper bytes of a PID) are found with one pass over
+// the keys and skipped.
+void radix_sort_keys(child_key_t *keys, child_key_t *scratch, int count) {
+    uint64_t varying[3] = {0, 0, 0};
+    for (int i = 1; i < count; i++) {
+        for (int word = 0; word < 3; word++) {
+            varying[word] |= keys[i].words[word] ^ keys[0].words[word];
+        }
+    }
+    
+    child_key_t *from = keys;
+    child_key_t *to = scratch;
+    for (int word = 2; word >= 0; word--) {
+        for (int shift = 0; shift < 64; shift += 8) {
+            if (!((varying[word] >> shift) & 0xff)) {
+                continue;
+            }
+            int counts[256] = {0};
+            for (int i = 0; i < count; i++) {
+                counts[(from[i].words[word] >> shift) & 0xff]++;
+            }
+            int offset = 0;
+            for (int digit = 0; digit < 256; digit++) {
+                int n = counts[digit];
+                counts[digit] = offset;
+                offset += n;
+            }
+            for (int i = 0; i < count; i++) {
+                to[counts[(from[i].words[word] >> shift) & 0xff]++] = from[i];
+            }
+            child_key_t *swap = from;
+            from = to;
+            to = swap;
+        }
+    }
+    if (from != keys) {
+        memcpy(keys, from, count * sizeof(child_key_t));
+    }
+}
+
+// Sort an array of processes like qsort() with process_compare(), on keys
+// computed once per process. Without --sort the keys are radix sorted;
+// names that only differ after their first 16 bytes are then put in order
+// by a merge sort of each run of equal keys, already in PID order.
+void sort_processes(process_t **array, int count) {
+    if (count < 2) {
+        return;
+    }
+    if (count > sort_buffer.capacity) {
+        int capacity = sort_buffer.capacity ? sort_buffer.capacity : 256;
+        while (capacity < count) {
+            capacity *= 2;
+        }
+        free(sort_buffer.keys);
+        free(sort_buffer.scratch);
+        sort_buffer.keys = malloc(capacity * sizeof(child_key_t));
+        sort_buffer.scratch = malloc(capacity * sizeof(child_key_t));
+        if (!sort_buffer.keys || !sort_buffer.scratch) {
+            perror("malloc");
+            exit(1);
+        }
+        sort_buffer.capacity = capacity;
+    }
+    
+    child_key_t *keys = sort_buffer.keys;
+    for (int i = 0; i < count; i++) {
+        make_child_key(array[i], &keys[i]);
+    }
+    if (count <= SORT_INSERTION_MAX) {
+        insertion_sort_keys(keys, count);
+    } else if (options.sort_key != SORT_NONE) {
+        merge_sort_keys(keys, sort_buffer.scratch, count);
+    } else {
+        radix_sort_keys(keys, sort_buffer.scratch, count);
+        for (int start = 0; !options.numeric_sort && start < count; ) {
+            int end = start + 1;
+            while (end < count && keys[end].words[0] == keys[start].words[0] &&
+                   keys[end].words[1] == keys[start].words[1]) {
+                end++;
+            }
+            if (end - start > 1 && (keys[start].words[1] & 0xff)) {
+                merge_sort_keys(keys + start, sort_buffer.scratch, end - start);
+            }
+            start = end;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        array[i] = keys[i].proc;
+    }
+}
+
+// Insert child into parent's sorted children array. The slice of
+// child_pool is copied into an owned array the first time it grows.
+void insert_child(process_t *parent, process_t *child) {
+    if (parent->child_count >= parent->child_capacity) {
+        int capacity = parent->child_capacity ? parent->child_capacity * 2 : 4;
+        while (capacity <= parent->child_count) {
+            capacity *= 2;
+        }
+        process_t **children = malloc(capacity * sizeof(process_t *));
+        if (!children) {
+            perror("malloc");
+            exit(1);
+        }
+        if (parent->child_count > 0) {
+            memcpy(children, parent->children, parent->child_count * sizeof(process_t *));
+        }
+        if (parent->child_capacity > 0) {
+            free(parent->children);
+        }
+        parent->children = children;
+        parent->child_capacity = capacity;
+    }
+    
+    int low = 0;
+    int high = parent->child_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (process_compare(&parent->children[mid], &child) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    memmove(parent->children + low + 1, parent->children + low,
+            (parent->child_count - low) * sizeof(process_t *));
+    parent->children[low] = child;
+    parent->child_count++;
+    child->parent = parent;
+}
+
+// Remove child from parent's children array, keeping the order
+void remove_child(process_t *parent, process_t *child) {
+    for (int i = 0; i < parent->child_count; i++) {
+        if (parent->children[i] == child) {
+            memmove(parent->children + i, parent->children + i + 1,
+                    (parent->child_count - i - 1) * sizeof(process_t *));
+            parent->child_count--;
+            break;
+        }
+    }
+    child->parent = NULL;
+}
+
+// Append len bytes to a growable buffer
+void buffer_append(byte_buffer_t *buffer, const char *data, size_t len) {
+    if (buffer->len + len > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 64 * 1024;
+        while (capacity < buffer->len + len) {
+            capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, capacity);
+        if (!buffer->data) {
+            perror("realloc");
+            exit(1);
+        }
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+}
+
+// Append len bytes to the output buffer. Data that does not fit is written
+// together with the buffered output in one writev() call.
+void out_write(const char *data, size_t len) {
+    if (output.len + len <= OUTPUT_BUFFER_SIZE) {
+        memcpy(output.data + output.len, data, len);
+        output.len += len;
+        return;
+    }
+    
+    if (output.capture) {
+        buffer_append(output.capture, output.data, output.len);
+        buffer_append(output.capture, data, len);
+        output.len = 0;
+        return;
+    }
+    
+    struct iovec iov[2];
+    iov[0].iov_base = output.data;
+    iov[0].iov_len = output.len;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    
+    int iov_index = 0;
+    while (iov_index < 2) {
+        ssize_t written = writev(output.fd, iov + iov_index, 2 - iov_index);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        output.bytes_written += written;
+        while (iov_index < 2 && (size_t)written >= iov[iov_index].iov_len) {
+            written -= iov[iov_index].iov_len;
+            iov_index++;
+        }
+        if (iov_index < 2) {
+            iov[iov_index].iov_base = (char *)iov[iov_index].iov_base + written;
+            iov[iov_index].iov_len -= written;
+        }
+    }
+    output.len = 0;
+}
+
+// Append a string to the output buffer
+void out_str(const char *str) {
+    out_write(str, strlen(str));
+}
+
+// Append a decimal integer to the output buffer
+void out_int(int value) {
+    char digits[16];
+    int pos = sizeof(digits);
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    
+    do {
+        digits[--pos] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) {
+        digits[--pos] = '-';
+    }
+    out_write(digits + pos, sizeof(digits) - pos);
+}
+
+// Write out everything buffered so far
+void out_flush(void) {
+    if (output.capture) {
+        buffer_append(output.capture, output.data, output.len);
+        output.len = 0;
+        return;
+    }
+    
+    size_t offset = 0;
+    while (offset < output.len) {
+        ssize_t written = write(output.fd, output.data + offset, output.len - offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        offset += written;
+    }
+    output.bytes_written += offset;
+    output.len = 0;
+}
+
+// Append str to the shared prefix buffer
+void prefix_push(const char *str, size_t len) {
+    if (prefix.len + len > prefix.capacity) {
+        size_t capacity = prefix.capacity ? prefix.capacity * 2 : 1024;
+        while (capacity < prefix.len + len) {
+            capacity *= 2;
+        }
+        prefix.data = realloc(prefix.data, capacity);
+        if (!prefix.data) {
+            perror("realloc");
+            exit(1);
+        }
+        prefix.capacity = capacity;
+    }
+    memcpy(prefix.data + prefix.len, str, len);
+    prefix.len += len;
+}
+
+// Push a traversal frame for the children of proc
+void push_frame(process_t *proc, int visible_children) {
+    if (print_stack.depth >= print_stack.capacity) {
+        print_stack.capacity = print_stack.capacity ? print_stack.capacity * 2 : 64;
+        print_stack.frames = realloc(print_stack.frames,
+                                     print_stack.capacity * sizeof(print_frame_t));
+        if (!print_stack.frames) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    print_frame_t *frame = &print_stack.frames[print_stack.depth++];
+    frame->proc = proc;
+    frame->prefix_len = prefix.len;
+    frame->next_child = 0;
+    frame->remaining = visible_children;
+    frame->closers = 0;
+    frame->printed = 0;
+}
+
+// Write the line start for a node: shared prefix and branch characters,
+// and extend the prefix for the node's children
+void print_branch(int is_last) {
+    const char *branch, *continue_prefix;
+    if (options.ascii_mode) {
+        branch = is_last ? "`-" : "|-";
+        continue_prefix = is_last ? "  " : "| ";
+    } else {
+        branch = is_last ? "└─" : "├─";
+        continue_prefix = is_last ? "  " : "│ ";
+    }
+    
+    out_write(prefix.data, prefix.len);
+    out_str(branch);
+    prefix_push(continue_prefix, strlen(continue_prefix));
+}
+
+// Print the label of one node: name, PID, PGID, thread count and uid change
+void print_node(process_t *proc, int show_thread_count) {
+    // Check if this process should be highlighted
+    int highlight = should_highlight(proc);
+    if (highlight) {
+        out_str("\033[1m"); // Bold text
+    }
+    
+    // Print process name
+    print_diff_marker(proc);
+    if (options.show_args && proc_cmdline(proc)[0]) {
+        out_str(proc->cmdline);
+    } else {
+        out_str(proc->comm);
+    }
+    
+    // Print PID if requested
+    if (options.show_pids) {
+        out_write("(", 1);
+        out_int(proc->pid);
+        out_write(")", 1);
+    }
+    
+    // Print PGID if requested
+    if (options.show_pgids && proc->pgid != -1) {
+        out_write("[", 1);
+        out_int(proc->pgid);
+        out_write("]", 1);
+    }
+    
+    // Print subtree totals if requested
+    if (options.show_totals) {
+        char totals[128];
+        out_write(totals, format_totals(proc, totals, sizeof(totals)));
+    }
+    
+    // Print thread count if there are threads
+    if (show_thread_count) {
+        print_thread_count(proc);
+    }
+    
+    // Print UID change if requested
+    if (options.uid_changes && proc->ppid != 0) {
+        process_t *parent = proc->parent;
+        if (parent && parent->uid != proc->uid && proc->uid != -1) {
+            const char *name = user_name(proc->uid);
+            if (name) {
+                out_str("(user: ");
+                out_str(name);
+                out_write(")", 1);
+            } else {
+                out_str("(uid: ");
+                out_int(proc->uid);
+                out_write(")", 1);
+            }
+        }
+    }
+    
+    if (highlight) {
+        out_str("\033[0m"); // Reset text formatting
+    }
+}
+
+// Add uid to the user name cache unless it is there already, growing the
+// table to keep it at most half full. Returns the cached name.
+const char *user_cache_insert(int uid, const char *name) {
+    if ((unsigned int)(user_names.count + 1) * 2 > user_names.mask + 1) {
+        unsigned int capacity = user_names.slots ? (user_names.mask + 1) * 2 : 64;
+        user_entry_t *old_slots = user_names.slots;
+        unsigned int old_capacity = user_names.slots ? user_names.mask + 1 : 0;
+        user_names.slots = calloc(capacity, sizeof(user_entry_t));
+        if (!user_names.slots) {
+            perror("calloc");
+            exit(1);
+        }
+        user_names.mask = capacity - 1;
+        for (unsigned int i = 0; i < old_capacity; i++) {
+            if (old_slots[i].used) {
+                unsigned int slot = pid_hash(old_slots[i].uid) & user_names.mask;
+                while (user_names.slots[slot].used) {
+                    slot = (slot + 1) & user_names.mask;
+                }
+                user_names.slots[slot] = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+    
+    unsigned int slot = pid_hash(uid) & user_names.mask;
+    while (user_names.slots[slot].used) {
+        if (user_names.slots[slot].uid == uid) {
+            return user_names.slots[slot].name;  // The first entry wins, as with getpwuid()
+        }
+        slot = (slot + 1) & user_names.mask;
+    }
+    user_names.slots[slot].uid = uid;
+    user_names.slots[slot].name = name ? arena_strndup(&user_names.arena, name, strlen(name)) : NULL;
+    user_names.slots[slot].used = 1;
+    user_names.count++;
+    return user_names.slots[slot].name;
+}
+
+// Fill the user name cache with every user getpwent() lists
+void load_user_names(void) {
+    user_names.loaded = 1;
+    setpwent();
+    struct passwd *pw;
+    while ((pw = getpwent()) != NULL) {
+        user_cache_insert((int)pw->pw_uid, pw->pw_name);
+    }
+    endpwent();
+}
+
+// Name of the user with this uid, NULL if there is none
+const char *user_name(int uid) {
+    if (!user_names.loaded) {
+        load_user_names();
+    }
+    if (user_names.slots) {
+        unsigned int slot = pid_hash(uid) & user_names.mask;
+        while (user_names.slots[slot].used) {
+            if (user_names.slots[slot].uid == uid) {
+                return user_names.slots[slot].name;
+            }
+            slot = (slot + 1) & user_names.mask;
+        }
+    }
+    
+    struct passwd *pw = getpwuid(uid);
+    return user_cache_insert(uid, pw ? pw->pw_name : NULL);
+}
+
+// Print the ───N*[{comm}] thread summary unless -t shows threads as nodes
+void print_thread_count(process_t *proc) {
+    if (proc->thread_count > 0 && !options.show_threads) {
+        out_str("───");
+        out_int(proc->thread_count);
+        out_str("*[{");
+        out_str(proc->comm);
+        out_str("}]");
+    }
+}
+
+// Format the --totals annotation of proc, " [rss=... cpu=... procs=N
+// threads=N]" for its whole subtree. Returns the length written.
+size_t format_totals(process_t *proc, char *buf, size_t size) {
+    static long page_size = 0;
+    static long clock_ticks = 0;
+    if (!page_size) {
+        page_size = sysconf(_SC_PAGESIZE);
+        clock_ticks = sysconf(_SC_CLK_TCK);
+        if (page_size <= 0) page_size = 4096;
+        if (clock_ticks <= 0) clock_ticks = 100;
+    }
+    
+    // RSS in the largest binary unit that keeps it at or above 1
+    static const char units[] = "KMGT";
+    double rss = proc->total_rss * (double)page_size / 1024;
+    int unit = 0;
+    while (rss >= 1024 && unit < (int)sizeof(units) - 2) {
+        rss /= 1024;
+        unit++;
+    }
+    
+    int len = snprintf(buf, size, " [rss=%.1f%c cpu=%.2fs procs=%d threads=%d]",
+                       rss, units[unit], proc->total_cpu / (double)clock_ticks,
+                       proc->total_processes, proc->total_threads);
+    return len < (int)size ? (size_t)len : size - 1;
+}
+
+// Sum RSS, CPU time, processes and threads over every subtree below root
+// in one post-order pass, using the RSS and CPU time already parsed from
+// stat. Breadth-first order puts every child after its parent, so walking
+// it backwards finishes each child before its parent. With --sort the
+// children are reordered as soon as their totals are known, which only
+// touches the copies print_view() renders from.
+void compute_subtree_totals(process_t *root) {
+    process_t **order = malloc((process_count + 1) * sizeof(process_t *));
+    if (!order) {
+        perror("malloc");
+        exit(1);
+    }
+    
+    int count = 0;
+    order[count++] = root;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < order[i]->child_count; j++) {
+            order[count++] = order[i]->children[j];
+        }
+    }
+    
+    for (int i = count - 1; i >= 0; i--) {
+        process_t *proc = order[i];
+        // Thread records only stand for threads already in thread_count
+        int is_process = !proc->is_thread;
+        proc->total_rss = is_process ? proc->rss : 0;
+        proc->total_cpu = is_process ? proc->utime + proc->stime : 0;
+        proc->total_processes = is_process;
+        proc->total_threads = is_process ? proc->thread_count + 1 : 0;
+        for (int j = 0; j < proc->child_count; j++) {
+            process_t *child = proc->children[j];
+            proc->total_rss += child->total_rss;
+            proc->total_cpu += child->total_cpu;
+            proc->total_processes += child->total_processes;
+            proc->total_threads += child->total_threads;
+        }
+        if (options.sort_key != SORT_NONE && proc->child_count > 1) {
+            phase_begin(PHASE_SORT);
+            sort_processes(proc->children, proc->child_count);
+            phase_end();
+        }
+    }
+    
+    free(order);
+}
+
+// Print the process tree, one line per process
+void print_tree(process_t *root) {
+    if (!root || is_hidden(root)) return;
+    
+    prefix.len = 0;
+    print_stack.depth = 0;
+    
+    print_branch(1);
+    print_node(root, 0);
+    out_write("\n", 1);
+    output.lines++;
+    int visible = visible_child_count(root);
+    if (visible > 0) {
+        push_frame(root, visible);
+    }
+    
+    while (print_stack.depth > 0) {
+        print_frame_t *frame = &print_stack.frames[print_stack.depth - 1];
+        if (frame->remaining == 0) {
+            print_stack.depth--;
+            continue;
+        }
+        
+        // Thread records stay in the table (e.g. from a snapshot) when
+        // they are not displayed
+        process_t *child = frame->proc->children[frame->next_child++];
+        if (is_hidden(child)) {
+            continue;
+        }
+        int is_last = (--frame->remaining == 0);
+        prefix.len = frame->prefix_len;
+        
+        print_branch(is_last);
+        print_node(child, 0);
+        out_write("\n", 1);
+        output.lines++;
+        
+        visible = visible_child_count(child);
+        if (visible > 0) {
+            push_frame(child, visible);
+        }
+    }
+}
+
+// Count the children of proc that are displayed
+int visible_child_count(process_t *proc) {
+    int count = 0;
+    for (int i = 0; i < proc->child_count; i++) {
+        if (!is_hidden(proc->children[i])) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// First displayed child of proc, NULL if there is none
+process_t *first_visible_child(process_t *proc) {
+    for (int i = 0; i < proc->child_count; i++) {
+        if (!is_hidden(proc->children[i])) {
+            return proc->children[i];
+        }
+    }
+    return NULL;
+}
+
+// Hash of what the compact printer shows for one node, without children
+unsigned long long node_label_hash(process_t *proc) {
+    unsigned long long hash = 14695981039346656037ull;
+    const char *name = (options.show_args && proc_cmdline(proc)[0]) ? proc->cmdline : proc->comm;
+    for (const char *p = name; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ull;
+    }
+    
+    // The comm of chain nodes, thread summary, highlight and uid change
+    // are shown as well
+    for (const char *p = proc->comm; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ull;
+    }
+    hash = (hash ^ (unsigned int)(options.show_threads ? 0 : proc->thread_count)) * 1099511628211ull;
+    hash = (hash ^ (unsigned int)proc->is_highlighted) * 1099511628211ull;
+    hash = (hash ^ (unsigned int)proc->diff_state) * 1099511628211ull;
+    if (options.uid_changes && proc->parent && proc->parent->uid != proc->uid) {
+        hash = (hash ^ (unsigned int)proc->uid) * 1099511628211ull;
+    }
+    if (options.show_totals) {
+        hash = (hash ^ proc->total_rss) * 1099511628211ull;
+        hash = (hash ^ proc->total_cpu) * 1099511628211ull;
+        hash = (hash ^ (unsigned int)proc->total_threads) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Final mixing step for structural hashes (splitmix64)
+unsigned long long mix_hash(unsigned long long hash) {
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebull;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+int hash_compare(const void *a, const void *b) {
+    unsigned long long hash_a = *(const unsigned long long *)a;
+    unsigned long long hash_b = *(const unsigned long long *)b;
+    return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+// Order a run of siblings so that equal subtrees become adjacent while
+// keeping the position of the first one of each kind: sort by (first
+// index with the same hash, index)
+int group_compare(const void *a, const void *b) {
+    const sibling_key_t *key_a = a;
+    const sibling_key_t *key_b = b;
+    if (key_a->group != key_b->group) {
+        return key_a->group - key_b->group;
+    }
+    return key_a->index - key_b->index;
+}
+
+int sibling_hash_compare(const void *a, const void *b) {
+    const sibling_key_t *key_a = a;
+    const sibling_key_t *key_b = b;
+    if (key_a->proc->subtree_hash != key_b->proc->subtree_hash) {
+        return key_a->proc->subtree_hash < key_b->proc->subtree_hash ? -1 : 1;
+    }
+    return key_a->index - key_b->index;
+}
+
+// Make identical subtrees adjacent within one run of equally named siblings
+void group_sibling_run(process_t **run, int count, sibling_key_t *keys) {
+    for (int i = 0; i < count; i++) {
+        keys[i].proc = run[i];
+        keys[i].index = i;
+    }
+    
+    qsort(keys, count, sizeof(sibling_key_t), sibling_hash_compare);
+    int moved = 0;
+    for (int i = 0; i < count; i++) {
+        if (i == 0 || keys[i].proc->subtree_hash != keys[i - 1].proc->subtree_hash) {
+            keys[i].group = keys[i].index;
+        } else {
+            keys[i].group = keys[i - 1].group;
+            moved |= (keys[i].index != keys[i - 1].index + 1);
+        }
+    }
+    if (!moved) {
+        return;  // Equal subtrees are already next to each other
+    }
+    
+    qsort(keys, count, sizeof(sibling_key_t), group_compare);
+    for (int i = 0; i < count; i++) {
+        run[i] = keys[i].proc;
+    }
+}
+
+// Compute a structural hash for every subtree below root, bottom-up: the
+// node's label combined with the sorted hashes of its displayed children.
+// Equal siblings are then made adjacent so the compact printer can merge
+// them into N*[subtree] in a single pass.
+void group_identical_subtrees(process_t *root) {
+    // Breadth-first order puts every child after its parent
+    process_t **order = malloc((process_count + 1) * sizeof(process_t *));
+    unsigned long long *hashes = malloc((process_count + 1) * sizeof(unsigned long long));
+    sibling_key_t *keys = malloc((process_count + 1) * sizeof(sibling_key_t));
+    if (!order || !hashes || !keys) {
+        perror("malloc");
+        exit(1);
+    }
+    
+    int count = 0;
+    order[count++] = root;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < order[i]->child_count; j++) {
+            if (!is_hidden(order[i]->children[j])) {
+                order[count++] = order[i]->children[j];
+            }
+        }
+    }
+    
+    for (int i = count - 1; i >= 0; i--) {
+        process_t *proc = order[i];
+        int child_hashes = 0;
+        for (int j = 0; j < proc->child_count; j++) {
+            if (!is_hidden(proc->children[j])) {
+                hashes[child_hashes++] = proc->children[j]->subtree_hash;
+            }
+        }
+        qsort(hashes, child_hashes, sizeof(unsigned long long), hash_compare);
+        
+        unsigned long long hash = node_label_hash(proc);
+        for (int j = 0; j < child_hashes; j++) {
+            hash = mix_hash(hash ^ hashes[j]);
+        }
+        proc->subtree_hash = mix_hash(hash + child_hashes);
+        
+        // Children are ordered by name (or PID with -n or by --sort, where
+        // only neighbours can be merged): group within runs of the same name
+        if (!options.numeric_sort && options.sort_key == SORT_NONE && child_hashes > 1) {
+            int start = 0;
+            while (start < proc->child_count) {
+                int end = start + 1;
+                while (end < proc->child_count &&
+                       proc->children[end]->comm == proc->children[start]->comm) {
+                    end++;
+                }
+                if (end - start > 1) {
+                    group_sibling_run(proc->children + start, end - start, keys);
+                }
+                start = end;
+            }
+        }
+    }
+    
+    free(order);
+    free(hashes);
+    free(keys);
+}
+
+// Print one node of the compact tree. A chain of single children is printed
+// on the same line; the node whose children continue below is returned and
+// the prefix is padded to line them up under the end of the chain. A group
+// of group_count identical subtrees is printed once as N*[subtree], closers
+// is the number of brackets to close after the last line of this subtree.
+process_t *print_compact_node(process_t *proc, int is_last, int group_count, int closers) {
+    char group_prefix[16] = "";
+    
+    print_branch(is_last);
+    if (group_count > 1) {
+        snprintf(group_prefix, sizeof(group_prefix), "%d*[", group_count);
+        out_str(group_prefix);
+    }
+    print_node(proc, 1);
+    
+    // Always compress single-child chains, even if the last child has
+    // multiple children. This matches system pstree behavior.
+    process_t *current = proc;
+    if (!options.compact_not) {
+        while (visible_child_count(current) == 1) {
+            current = first_visible_child(current);
+            out_str("───");
+            print_diff_marker(current);
+            out_str(current->comm);
+            if (options.show_pids) {
+                out_write("(", 1);
+                out_int(current->pid);
+                out_write(")", 1);
+            }
+            print_thread_count(current);
+        }
+    }
+    
+    // This is the last line of the subtree if nothing is printed below it
+    if (visible_child_count(current) == 0) {
+        for (int i = 0; i < closers; i++) {
+            out_write("]", 1);
+        }
+    }
+    out_write("\n", 1);
+    output.lines++;
+    
+    // Align the children with the end of the compressed chain: the tree
+    // characters, the first name and every name in the chain except the
+    // last one
+    if (current != proc) {
+        size_t chain_length = 2 + strlen(group_prefix) + strlen(proc->comm) +
+                              (proc->diff_state != DIFF_SAME);
+        if (options.show_totals) {
+            char totals[128];
+            chain_length += format_totals(proc, totals, sizeof(totals));
+        }
+        process_t *temp = first_visible_child(proc);
+        while (temp != current) {
+            chain_length += 3 + strlen(temp->comm) + (temp->diff_state != DIFF_SAME);
+            temp = first_visible_child(temp);
+        }
+        while (chain_length > 0) {
+            static const char spaces[] = "                                ";
+            size_t len = chain_length < sizeof(spaces) - 1 ? chain_length : sizeof(spaces) - 1;
+            prefix_push(spaces, len);
+            chain_length -= len;
+        }
+    }
+    return current;
+}
+
+// Queue a node for render_order_begin()
+void render_order_push(process_t *proc) {
+    if (render_order.node_count >= render_order.node_capacity) {
+        render_order.node_capacity = render_order.node_capacity ? render_order.node_capacity * 2 : 256;
+        render_order.nodes = realloc(render_order.nodes, render_order.node_capacity * sizeof(process_t *));
+        render_order.saved = realloc(render_order.saved, render_order.node_capacity * sizeof(process_t **));
+        if (!render_order.nodes || !render_order.saved) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    render_order.nodes[render_order.node_count++] = proc;
+}
+
+// Point the children of every node below root at copies that the render
+// may reorder freely. render_order_end() puts the originals back.
+void render_order_begin(process_t *root) {
+    render_order.node_count = 0;
+    render_order_push(root);
+    int child_total = 0;
+    for (int i = 0; i < render_order.node_count; i++) {
+        process_t *proc = render_order.nodes[i];
+        for (int j = 0; j < proc->child_count; j++) {
+            render_order_push(proc->children[j]);
+        }
+        child_total += proc->child_count;
+    }
+    
+    if (child_total > render_order.pool_capacity) {
+        free(render_order.pool);
+        render_order.pool_capacity = child_total;
+        render_order.pool = malloc(child_total * sizeof(process_t *));
+        if (!render_order.pool) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    int offset = 0;
+    for (int i = 0; i < render_order.node_count; i++) {
+        process_t *proc = render_order.nodes[i];
+        render_order.saved[i] = proc->children;
+        if (proc->child_count > 0) {
+            memcpy(render_order.pool + offset, proc->children, proc->child_count * sizeof(process_t *));
+        }
+        proc->children = render_order.pool + offset;
+        offset += proc->child_count;
+    }
+}
+
+// Give the nodes of the last render_order_begin() their own children back
+void render_order_end(void) {
+    for (int i = 0; i < render_order.node_count; i++) {
+        render_order.nodes[i]->children = render_order.saved[i];
+    }
+    render_order.node_count = 0;
+}
+
+// Print compact tree (like system pstree). Identical sibling subtrees are
+// merged into one N*[subtree] entry unless -c is given. The grouping
+// reorders children arrays, print_view() hands in copies for that.
+void print_compact_tree(process_t *root) {
+    if (!root || is_hidden(root)) return;
+    
+    if (!options.compact_not) {
+        group_identical_subtrees(root);
+    }
+    
+    prefix.len = 0;
+    print_stack.depth = 0;
+    
+    process_t *current = print_compact_node(root, 1, 1, 0);
+    int visible = visible_child_count(current);
+    if (visible > 0) {
+        push_frame(current, visible);
+    }
+    
+    while (print_stack.depth > 0) {
+        print_frame_t *frame = &print_stack.frames[print_stack.depth - 1];
+        if (frame->remaining == 0) {
+            print_stack.depth--;
+            continue;
+        }
+        
+        process_t *child = frame->proc->children[frame->next_child++];
+        if (is_hidden(child)) {
+            continue;
+        }
+        
+        // Count the identical subtrees that follow this one
+        int group_count = 1;
+        while (!options.compact_not && frame->next_child < frame->proc->child_count) {
+            process_t *next = frame->proc->children[frame->next_child];
+            if (!is_hidden(next) && next->subtree_hash != child->subtree_hash) {
+                break;
+            }
+            frame->next_child++;
+            if (!is_hidden(next)) {
+                group_count++;
+            }
+        }
+        
+        frame->remaining -= group_count;
+        int is_last = (frame->remaining == 0);
+        int closers = (is_last ? frame->closers : 0) + (group_count > 1 ? 1 : 0);
+        prefix.len = frame->prefix_len;
+        
+        current = print_compact_node(child, is_last, group_count, closers);
+        visible = visible_child_count(current);
+        if (visible > 0) {
+            push_frame(current, visible);
+            print_stack.frames[print_stack.depth - 1].closers = closers;
+        }
+    }
+}
+
+// Append str as a JSON string. Control characters, quotes and backslashes
+// are escaped; each byte that is not part of valid UTF-8 (RFC 3629) is
+// written as U+FFFD so the output always parses.
+void out_json_string(const char *str) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *)str;
+    const unsigned char *run = p;   // Bytes that can be copied as they are
+    out_write("\"", 1);
+    while (*p) {
+        size_t length = 0;
+        if (*p >= 0x20 && *p < 0x7f && *p != '"' && *p != '\\') {
+            length = 1;
+        } else if (*p >= 0xc2 && *p <= 0xdf) {
+            length = 2;
+        } else if (*p >= 0xe0 && *p <= 0xef) {
+            length = 3;
+        } else if (*p >= 0xf0 && *p <= 0xf4) {
+            length = 4;
+        }
+        
+        // The second byte after E0, ED, F0 and F4 is narrower, to rule out
+        // overlong forms, UTF-16 surrogates and code points past U+10FFFF
+        unsigned char low = *p == 0xe0 ? 0xa0 : *p == 0xf0 ? 0x90 : 0x80;
+        unsigned char high = *p == 0xed ? 0x9f : *p == 0xf4 ? 0x8f : 0xbf;
+        if (length > 1 && (p[1] < low || p[1] > high)) {
+            length = 0;
+        }
+        for (size_t i = 1; i < length; i++) {
+            if ((p[i] & 0xc0) != 0x80) {
+                length = 0;
+                break;
+            }
+        }
+        if (length > 0) {
+            p += length;
+            continue;
+        }
+        
+        out_write((const char *)run, p - run);
+        if (*p == '"' || *p == '\\') {
+            char escaped[2] = {'\\', (char)*p};
+            out_write(escaped, 2);
+        } else if (*p < 0x80) {
+            char escaped[6] = {'\\', 'u', '0', '0', hex[*p >> 4], hex[*p & 15]};
+            out_write(escaped, 6);
+        } else {
+            out_write("\\ufffd", 6);
+        }
+        run = ++p;
+    }
+    out_write((const char *)run, p - run);
+    out_write("\"", 1);
+}
+
+// Append the fields of one node as an unterminated JSON object
+void print_json_node(process_t *proc) {
+    out_str("{\"pid\":");
+    out_int(proc->pid);
+    out_str(",\"ppid\":");
+    out_int(proc->ppid);
+    out_str(",\"pgid\":");
+    out_int(proc->pgid);
+    out_str(",\"uid\":");
+    out_int(proc->uid);
+    out_str(",\"comm\":");
+    out_json_string(proc->comm);
+    out_str(",\"cmdline\":");
+    out_json_string(proc_cmdline(proc));
+    out_str(",\"thread_count\":");
+    out_int(proc->thread_count);
+}
+
+// Stream the tree below root in the --format given, in the same
+// depth-first order as the text output. Nodes go straight into the output
+// buffer, so memory use does not depend on the size of the tree. JSON
+// nests children in a "children" array and separates trees with commas,
+// main() opens and closes the enclosing array.
+void print_json_tree(process_t *root) {
+    if (!root || is_hidden(root)) return;
+    
+    int nested = options.format == FORMAT_JSON;
+    if (nested && output.trees++ > 0) {
+        out_write(",", 1);
+    }
+    print_stack.depth = 0;
+    
+    print_json_node(root);
+    out_str(nested ? ",\"children\":[" : "}\n");
+    push_frame(root, visible_child_count(root));
+    
+    while (print_stack.depth > 0) {
+        print_frame_t *frame = &print_stack.frames[print_stack.depth - 1];
+        if (frame->remaining == 0) {
+            if (nested) {
+                out_write("]}", 2);
+            }
+            print_stack.depth--;
+            continue;
+        }
+        
+        process_t *child = frame->proc->children[frame->next_child++];
+        if (is_hidden(child)) {
+            continue;
+        }
+        frame->remaining--;
+        if (nested && frame->printed++ > 0) {
+            out_write(",", 1);
+        }
+        output.lines++;
+        
+        print_json_node(child);
+        out_str(nested ? ",\"children\":[" : "}\n");
+        push_frame(child, visible_child_count(child));
+    }
+    output.lines++;
+}
+
+// Check if a name represents a thread
+int is_thread_name(const char *name) {
+    return name && name[0] == '{' && name[strlen(name) - 1] == '}';
+}
+
+// Thread records are only displayed when -t asks for thread names, and
+// --diff prunes subtrees without changes
+int is_hidden(process_t *proc) {
+    return (proc->is_thread && !options.show_threads) ||
+           (options.diff_from && !proc->diff_shown);
+}
+
+// Merge threads into their parent processes
+void merge_threads(void) {
+    // Thread counting is now done during scanning
+    // This function is kept for compatibility
+    return;
+}
+
+// Flag the -H process and all its ancestors, following parent pointers
+void mark_highlight_path(void) {
+    for (int i = 0; i < process_count; i++) {
+        processes[i]->is_highlighted = 0;
+    }
+    if (options.highlight_pid <= 0) {
+        return;
+    }
+    
+    for (process_t *proc = find_process(options.highlight_pid); proc; proc = proc->parent) {
+        proc->is_highlighted = 1;
+    }
+}
+
+// Check if a process should be highlighted
+int should_highlight(process_t *proc) {
+    return proc->is_highlighted;
+}
+
+// Free all allocated memory
+void free_processes(void) {
+    for (int i = 0; i < process_count; i++) {
+        if (processes[i]->child_capacity > 0) {
+            free(processes[i]->children);
+        }
+        free(processes[i]->cmdline_buffer);
+    }
+    process_count = 0;
+    process_capacity = 0;
+    free(processes);
+    processes = NULL;
+    arena_free(&process_arena);
+    intern_free(&comm_names);
+    free(child_pool);
+    child_pool = NULL;
+    free(pid_index.slots);
+    pid_index.slots = NULL;
+    free(sort_buffer.keys);
+    free(sort_buffer.scratch);
+    memset(&sort_buffer, 0, sizeof(sort_buffer));
+    free(render_order.nodes);
+    free(render_order.saved);
+    free(render_order.pool);
+    memset(&render_order, 0, sizeof(render_order));
+    free(uid_index.slots);
+    uid_index.slots = NULL;
+    free(user_names.slots);
+    arena_free(&user_names.arena);
+    memset(&user_names, 0, sizeof(user_names));
+    
+    if (snapshot.map) {
+        munmap(snapshot.map, snapshot.size);
+        snapshot.map = NULL;
+    }
+    
+    free(watch.pids);
+    free(watch.job.results);
+    free(watch.orphans);
+    free(watch.frame.data);
+    free(watch.shown.data);
+    intern_free(&watch.job.names);
+    arena_free(&watch.job.arena);
+    memset(&watch, 0, sizeof(watch));
+}
+
+// Order PID list entries by PID
+int pid_entry_compare(const void *a, const void *b) {
+    const pid_entry_t *entry_a = a;
+    const pid_entry_t *entry_b = b;
+    return (entry_a->pid > entry_b->pid) - (entry_a->pid < entry_b->pid);
+}
+
+// Remove a record from the process table, moving the last one into its place
+void table_remove(process_t *proc) {
+    process_t *last = processes[--process_count];
+    processes[proc->table_index] = last;
+    last->table_index = proc->table_index;
+    proc->table_index = -1;
+}
+
+// Hand a record that left the table back to the refresh scanner
+void recycle_process(process_t *proc) {
+    if (proc->child_capacity > 0) {
+        free(proc->children);
+    }
+    free(proc->cmdline_buffer);
+    proc->cmdline_buffer = NULL;
+    proc->children = NULL;
+    proc->child_count = 0;
+    proc->child_capacity = 0;
+    proc->parent = watch.job.recycled;
+    watch.job.recycled = proc;
+}
+
+// Take a process out of the tree, the table and the index. Its thread
+// records go with it, its other children are left for reattach_orphan().
+void detach_process(process_t *proc) {
+    if (proc->parent) {
+        remove_child(proc->parent, proc);
+    }
+    
+    for (int i = 0; i < proc->child_count; i++) {
+        process_t *child = proc->children[i];
+        child->parent = NULL;
+        if (child->is_thread) {
+            pid_index_remove(child);
+            table_remove(child);
+            recycle_process(child);
+            continue;
+        }
+        
+        if (watch.orphan_count >= watch.orphan_capacity) {
+            watch.orphan_capacity = watch.orphan_capacity ? watch.orphan_capacity * 2 : 64;
+            watch.orphans = realloc(watch.orphans, watch.orphan_capacity * sizeof(process_t *));
+            if (!watch.orphans) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        watch.orphans[watch.orphan_count++] = child;
+    }
+    
+    pid_index_remove(proc);
+    table_remove(proc);
+    recycle_process(proc);
+}
+
+// The kernel moves the children of an exited process to a new parent
+// (init or a subreaper), so read the new PPID from stat and relink
+void reattach_orphan(process_t *proc) {
+    char path[32];
+    char buf[4096];
+    char comm[MAX_COMM];
+    process_t current = {0};
+    
+    snprintf(path, sizeof(path), "%d/stat", proc->pid);
+    if (read_file_at(proc_fd, path, buf, sizeof(buf), FIELD_STAT) <= 0 ||
+        parse_stat(buf, &current, comm) != 0 ||
+        (proc->starttime && current.starttime != proc->starttime)) {
+        return;  // Exited too, the next refresh removes it
+    }
+    
+    proc->ppid = current.ppid;
+    proc->pgid = current.pgid;
+    proc->thread_count = current.thread_count;
+    process_t *parent = find_process(proc->ppid);
+    if (parent && parent != proc) {
+        insert_child(parent, proc);
+    }
+}
+
+// Read the stat of a process the last listing had as well and update what
+// changes as it runs. Returns -1 when the record has to be read again: the
+// PID was reused (another starttime), it exec'd (another comm), it moved
+// to another parent, its threads changed under -t, or it is gone.
+// entry->starttime is updated either way.
+int refresh_stat(process_t *proc, pid_entry_t *entry) {
+    char path[32];
+    char buf[4096];
+    char comm[MAX_COMM];
+    process_t current = {0};
+    
+    snprintf(path, sizeof(path), "%d/stat", proc->pid);
+    if (read_file_at(proc_fd, path, buf, sizeof(buf), FIELD_STAT) <= 0 ||
+        parse_stat(buf, &current, comm) != 0) {
+        entry->starttime = 0;
+        return -1;
+    }
+    if (current.starttime != entry->starttime) {
+        entry->starttime = current.starttime;
+        return -1;
+    }
+    
+    // The same braces parse_process_info() strips
+    char *name = comm;
+    size_t len = strlen(comm);
+    if (len > 1 && comm[0] == '{' && comm[len - 1] == '}') {
+        comm[len - 1] = '\0';
+        name++;
+    }
+    if (strcmp(name, proc->comm) != 0 || current.ppid != proc->ppid ||
+        (options.show_threads && current.thread_count != proc->thread_count)) {
+        return -1;
+    }
+    proc->pgid = current.pgid;
+    proc->thread_count = current.thread_count;
+    proc->utime = current.utime;
+    proc->stime = current.stime;
+    proc->rss = current.rss;
+    return 0;
+}
+
+// Add the records read into watch.job to the table, the index and the
+// tree. Parents read in the same batch are found regardless of the order.
+void attach_loaded_processes(void) {
+    for (int i = 0; i < watch.job.result_count; i++) {
+        process_t *proc = watch.job.results[i];
+        proc->comm = intern(&comm_names, proc->comm);
+        table_append(proc);
+        pid_index_insert(proc);
+    }
+    for (int i = 0; i < watch.job.result_count; i++) {
+        process_t *proc = watch.job.results[i];
+        process_t *parent = find_process(proc->ppid);
+        if (parent && parent != proc) {
+            insert_child(parent, proc);
+        }
+    }
+    watch.job.result_count = 0;
+}
+
+// Bring the table up to date with the proc root. A fresh PID listing is
+// merged with the previous one: exited PIDs are detached, new PIDs are
+// read, and PIDs whose stat shows another process (reused or exec'd) are
+// read again. The other processes only get their counters updated from
+// stat, so the work beyond one stat read per process follows the churn.
+void refresh_processes(void) {
+    pid_entry_t *pids = NULL;
+    int pid_count = read_pid_list(&pids);
+    
+    // /proc lists PIDs in order already, only sort when it did not
+    int sorted = 1;
+    for (int i = 1; i < pid_count && sorted; i++) {
+        sorted = pids[i - 1].pid < pids[i].pid;
+    }
+    if (!sorted) {
+        qsort(pids, pid_count, sizeof(pid_entry_t), pid_entry_compare);
+    }
+    
+    // Merge the two sorted lists, noting the positions in pids to read
+    int load_count = 0;
+    int old_index = 0;
+    int new_index = 0;
+    watch.added = watch.exited = watch.changed = 0;
+    watch.orphan_count = 0;
+    int *load = malloc((pid_count ? pid_count : 1) * sizeof(int));
+    if (!load) {
+        perror("malloc");
+        exit(1);
+    }
+    while (old_index < watch.pid_count || new_index < pid_count) {
+        pid_entry_t *old_entry = old_index < watch.pid_count ? &watch.pids[old_index] : NULL;
+        pid_entry_t *new_entry = new_index < pid_count ? &pids[new_index] : NULL;
+        
+        if (!new_entry || (old_entry && old_entry->pid < new_entry->pid)) {
+            process_t *proc = find_process(old_entry->pid);
+            if (proc && !proc->is_thread) {
+                detach_process(proc);
+            }
+            watch.exited++;
+            old_index++;
+        } else if (!old_entry || new_entry->pid < old_entry->pid) {
+            load[load_count++] = new_index;
+            watch.added++;
+            new_index++;
+        } else {
+            process_t *proc = find_process(old_entry->pid);
+            new_entry->starttime = old_entry->starttime;
+            if (proc && !proc->is_thread && refresh_stat(proc, new_entry) != 0) {
+                detach_process(proc);
+                load[load_count++] = new_index;
+                watch.changed++;
+            }
+            old_index++;
+            new_index++;
+        }
+    }
+    free(watch.pids);
+    watch.pids = pids;
+    watch.pid_count = pid_count;
+    
+    // Drop orphans that exited in this refresh as well
+    int orphan_count = 0;
+    for (int i = 0; i < watch.orphan_count; i++) {
+        if (watch.orphans[i]->table_index >= 0) {
+            watch.orphans[orphan_count++] = watch.orphans[i];
+        }
+    }
+    watch.orphan_count = orphan_count;
+    
+    // Read the new processes
+    watch.job.result_count = 0;
+    if (!watch.job.names.arena) {
+        watch.job.names.arena = &watch.job.arena;
+    }
+    for (int i = 0; i < load_count; i++) {
+        load_process(pids[load[i]].pid, &watch.job);
+    }
+    attach_loaded_processes();
+    for (int i = 0; i < load_count; i++) {
+        process_t *proc = find_process(pids[load[i]].pid);
+        pids[load[i]].starttime = proc ? proc->starttime : 0;
+    }
+    free(load);
+    
+    for (int i = 0; i < watch.orphan_count; i++) {
+        reattach_orphan(watch.orphans[i]);
+    }
+    
+    mark_highlight_path();
+}
+
+// Print the tree below target_pid, or a note when it does not exist
+void print_view(process_t *root, int target_pid) {
+    if (!root) {
+        out_str("Process ");
+        out_int(target_pid);
+        out_str(" not found\n");
+        return;
+    }
+    
+    // --sort and the compact grouping reorder children for this render only
+    int reorder = options.sort_key != SORT_NONE ||
+                  (options.format == FORMAT_TEXT && !options.compact_not);
+    if (reorder) {
+        render_order_begin(root);
+    }
+    if (options.show_totals || options.sort_key != SORT_NONE) {
+        compute_subtree_totals(root);
+    }
+    if (options.format != FORMAT_TEXT) {
+        print_json_tree(root);
+    } else if (options.compact_not) {
+        print_tree(root);
+    } else {
+        print_compact_tree(root);
+    }
+    if (reorder) {
+        render_order_end();
+    }
+}
+
+// Redraw the terminal for one --watch refresh. The tree is captured into
+// watch.frame and compared line by line with what is on the screen; only
+// lines that differ are rewritten, each in place with a cursor move.
+void draw_watch_frame(int target_pid, const char *header) {
+    int changes = watch.added + watch.exited + watch.changed;
+    int rows = 0;
+    struct winsize size;
+    if (ioctl(output.fd, TIOCGWINSZ, &size) == 0 && size.ws_row > 1) {
+        rows = size.ws_row - 1;  // The first row holds the header
+    }
+    
+    int full_redraw = !watch.shown.data || rows != watch.terminal_rows;
+    if (full_redraw || changes > 0) {
+        watch.frame.len = 0;
+        output.capture = &watch.frame;
+        print_view(find_process(target_pid), target_pid);
+        out_flush();
+        output.capture = NULL;
+    }
+    
+    char line[128];
+    if (full_redraw) {
+        out_str("\033[?7l\033[H\033[2J");  // No line wrapping, clear screen
+    }
+    out_str("\033[H");
+    out_str(header);
+    out_str("\033[K");
+    
+    // Nothing changed, the tree on the screen is still right
+    if (!full_redraw && changes == 0) {
+        snprintf(line, sizeof(line), "\033[%d;1H", watch.shown_rows + 2);
+        out_str(line);
+        out_flush();
+        return;
+    }
+    
+    // Walk the new and the shown frame together, one line at a time
+    const char *new_pos = watch.frame.data;
+    const char *new_end = watch.frame.data + watch.frame.len;
+    const char *old_pos = full_redraw ? NULL : watch.shown.data;
+    const char *old_end = full_redraw ? NULL : watch.shown.data + watch.shown.len;
+    int row = 0;
+    while (new_pos < new_end && (rows == 0 || row < rows)) {
+        const char *new_line_end = memchr(new_pos, '\n', new_end - new_pos);
+        size_t new_len = new_line_end ? (size_t)(new_line_end - new_pos) : (size_t)(new_end - new_pos);
+        
+        int same = 0;
+        if (old_pos && old_pos < old_end) {
+            const char *old_line_end = memchr(old_pos, '\n', old_end - old_pos);
+            size_t old_len = old_line_end ? (size_t)(old_line_end - old_pos) : (size_t)(old_end - old_pos);
+            same = (old_len == new_len && memcmp(old_pos, new_pos, new_len) == 0);
+            old_pos += old_len + 1;
+        }
+        
+        if (!same) {
+            snprintf(line, sizeof(line), "\033[%d;1H", row + 2);
+            out_str(line);
+            out_write(new_pos, new_len);
+            out_str("\033[K");
+        }
+        new_pos += new_len + 1;
+        row++;
+    }
+    
+    // Clear whatever is left of a longer previous frame
+    if (row < watch.shown_rows) {
+        snprintf(line, sizeof(line), "\033[%d;1H\033[J", row + 2);
+        out_str(line);
+    }
+    snprintf(line, sizeof(line), "\033[%d;1H", row + 2);
+    out_str(line);
+    out_flush();
+    
+    byte_buffer_t swap = watch.shown;
+    watch.shown = watch.frame;
+    watch.frame = swap;
+    watch.shown_rows = row;
+    watch.terminal_rows = rows;
+}
+
+// SIGINT/SIGTERM end --watch after the current refresh
+void watch_signal(int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+
+// End --watch and --follow on SIGINT/SIGTERM, without SA_RESTART so the
+// sleep or poll in progress is interrupted
+void catch_watch_signals(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = watch_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+// Refresh and redraw every options.watch_interval seconds until interrupted
+int watch_processes(int target_pid) {
+    catch_watch_signals();
+    qsort(watch.pids, watch.pid_count, sizeof(pid_entry_t), pid_entry_compare);
+    mark_highlight_path();
+    
+    double refresh_ms = phase_ms[PHASE_SCAN] + phase_ms[PHASE_BUILD] + phase_ms[PHASE_SORT];
+    while (!watch_stop) {
+        char header[128];
+        snprintf(header, sizeof(header), "pstree: %d processes  +%d -%d ~%d  refresh %.2f ms",
+                 process_count, watch.added, watch.exited, watch.changed, refresh_ms);
+        
+        phase_begin(PHASE_PRINT);
+        draw_watch_frame(target_pid, header);
+        phase_end();
+        
+        struct timespec delay;
+        delay.tv_sec = (time_t)options.watch_interval;
+        delay.tv_nsec = (long)((options.watch_interval - delay.tv_sec) * 1e9);
+        if (nanosleep(&delay, NULL) != 0 || watch_stop) {
+            break;
+        }
+        
+        double refresh_start = now_ms();
+        phase_begin(PHASE_SCAN);
+        refresh_processes();
+        phase_end();
+        refresh_ms = now_ms() - refresh_start;
+    }
+    
+    out_str("\033[?7h");  // Line wrapping back on
+    out_flush();
+    return 0;
+}
+
+// Send a listen/ignore request to the proc connector
+int follow_send(int fd, enum proc_cn_mcast_op op) {
+    union {
+        struct nlmsghdr header;
+        char data[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))];
+    } request;
+    memset(&request, 0, sizeof(request));
+    
+    request.header.nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+    request.header.nlmsg_type = NLMSG_DONE;
+    request.header.nlmsg_pid = getpid();
+    struct cn_msg *message = NLMSG_DATA(&request.header);
+    message->id.idx = CN_IDX_PROC;
+    message->id.val = CN_VAL_PROC;
+    message->len = sizeof(op);
+    memcpy(message->data, &op, sizeof(op));
+    
+    return send(fd, &request, request.header.nlmsg_len, 0) < 0 ? -1 : 0;
+}
+
+// Subscribe to fork/exec/exit events of the kernel's proc connector.
+// Returns the socket, or -1 when it is unavailable (no CAP_NET_ADMIN, no
+// connector support, or a proc root other than /proc).
+int follow_connect(void) {
+    if (strcmp(options.proc_root, "/proc") != 0) {
+        return -1;
+    }
+    
+    int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (fd < 0) {
+        return -1;
+    }
+    
+    struct sockaddr_nl address;
+    memset(&address, 0, sizeof(address));
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = CN_IDX_PROC;
+    address.nl_pid = getpid();
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        follow_send(fd, PROC_CN_MCAST_LISTEN) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Give a process a new name, keeping its siblings sorted
+void set_process_comm(process_t *proc, const char *name) {
+    if (!watch.job.names.arena) {
+        watch.job.names.arena = &watch.job.arena;
+    }
+    const char *comm = intern(&comm_names, intern(&watch.job.names, name));
+    if (comm == proc->comm) {
+        return;
+    }
+    
+    proc->comm = comm;
+    process_t *parent = proc->parent;
+    if (parent) {
+        remove_child(parent, proc);
+        insert_child(parent, proc);
+    }
+}
+
+// Read a process again after exec() replaced its image
+void reread_process(process_t *proc) {
+    char name[16];
+    snprintf(name, sizeof(name), "%d", proc->pid);
+    int pid_fd = openat(proc_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    count_syscalls(FIELD_STAT, 1);
+    if (pid_fd < 0) {
+        return;  // Already gone, the exit event follows
+    }
+    count_io(1, 0);
+    
+    process_t current = {0};
+    if (!watch.job.names.arena) {
+        watch.job.names.arena = &watch.job.arena;
+    }
+    if (read_process_info(pid_fd, proc->pid, &current, &watch.job) == 0) {
+        proc->uid = current.uid;
+        proc->pgid = current.pgid;
+        proc->cmdline = current.cmdline;
+        proc->thread_count = current.thread_count;
+        proc->starttime = current.starttime;
+        proc->utime = current.utime;
+        proc->stime = current.stime;
+        proc->rss = current.rss;
+        set_process_comm(proc, current.comm);
+    }
+    close(pid_fd);
+    count_syscalls(FIELD_STAT, 1);
+}
+
+// Read a process the events mention but the table does not have yet
+void load_new_process(int pid) {
+    if (!watch.job.names.arena) {
+        watch.job.names.arena = &watch.job.arena;
+    }
+    watch.job.result_count = 0;
+    load_process(pid, &watch.job);
+    attach_loaded_processes();
+}
+
+// fork(): the child starts as a copy of its parent, which costs no reads.
+// A new thread only changes the thread count, or adds a {name} record
+// with -t.
+void follow_fork(struct proc_event *event) {
+    int parent_pid = event->event_data.fork.parent_tgid;
+    int child_pid = event->event_data.fork.child_pid;
+    int child_tgid = event->event_data.fork.child_tgid;
+    
+    if (child_pid != child_tgid) {
+        process_t *proc = find_process(child_tgid);
+        if (!proc) {
+            return;
+        }
+        proc->thread_count++;
+        watch.changed++;
+        if (options.show_threads) {
+            char braced[MAX_COMM];
+            snprintf(braced, sizeof(braced), "{%s}", proc->comm);
+            process_t *thread = job_alloc_process(&watch.job);
+            thread->pid = child_pid;
+            thread->ppid = proc->pid;
+            thread->uid = proc->uid;
+            thread->pgid = proc->pgid;
+            thread->is_thread = 1;
+            thread->comm = proc->comm;
+            table_append(thread);
+            pid_index_insert(thread);
+            set_process_comm(thread, braced);
+            insert_child(proc, thread);
+        }
+        return;
+    }
+    
+    process_t *stale = find_process(child_pid);
+    if (stale) {
+        detach_process(stale);
+    }
+    
+    process_t *parent = find_process(parent_pid);
+    if (!parent) {
+        load_new_process(child_pid);
+        watch.added++;
+        return;
+    }
+    
+    process_t *child = job_alloc_process(&watch.job);
+    child->pid = child_pid;
+    child->ppid = parent->pid;
+    child->uid = parent->uid;
+    child->pgid = parent->pgid;
+    child->comm = parent->comm;
+    child->cmdline = NULL;  // Same as the parent's until exec, read when printed
+    child->rss = parent->rss;  // Shares the parent's pages, no CPU time yet
+    table_append(child);
+    pid_index_insert(child);
+    insert_child(parent, child);
+    watch.added++;
+}
+
+// exit(): the kernel has already moved the children to their new parent
+void follow_exit(struct proc_event *event) {
+    int pid = event->event_data.exit.process_pid;
+    int tgid = event->event_data.exit.process_tgid;
+    
+    if (pid != tgid) {
+        process_t *proc = find_process(tgid);
+        if (proc && proc->thread_count > 0) {
+            proc->thread_count--;
+            watch.changed++;
+        }
+        process_t *thread = find_process(pid);
+        if (thread && thread->is_thread) {
+            detach_process(thread);
+        }
+        return;
+    }
+    
+    process_t *proc = find_process(pid);
+    if (!proc || proc->is_thread) {
+        return;
+    }
+    watch.orphan_count = 0;
+    detach_process(proc);
+    for (int i = 0; i < watch.orphan_count; i++) {
+        reattach_orphan(watch.orphans[i]);
+    }
+    watch.exited++;
+}
+
+// Apply one proc connector event to the tree
+void apply_proc_event(struct proc_event *event) {
+    process_t *proc;
+    switch (event->what) {
+        case PROC_EVENT_FORK:
+            follow.events[EVENT_FORK]++;
+            follow_fork(event);
+            break;
+        case PROC_EVENT_EXEC:
+            follow.events[EVENT_EXEC]++;
+            proc = find_process(event->event_data.exec.process_tgid);
+            if (proc) {
+                reread_process(proc);
+                watch.changed++;
+            } else {
+                load_new_process(event->event_data.exec.process_tgid);
+                watch.added++;
+            }
+            break;
+        case PROC_EVENT_EXIT:
+            follow.events[EVENT_EXIT]++;
+            follow_exit(event);
+            break;
+        case PROC_EVENT_COMM:
+            proc = find_process(event->event_data.comm.process_pid);
+            if (proc) {
+                char name[MAX_COMM];
+                snprintf(name, sizeof(name), proc->is_thread ? "{%.16s}" : "%.16s",
+                         event->event_data.comm.comm);
+                set_process_comm(proc, name);
+                watch.changed++;
+            }
+            break;
+        case PROC_EVENT_UID:
+            proc = find_process(event->event_data.id.process_tgid);
+            if (proc && proc->uid != -1) {
+                proc->uid = (int)event->event_data.id.e.euid;
+                watch.changed++;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Read and apply every event queued on the connector socket
+void follow_receive(void) {
+    union {
+        struct nlmsghdr header;
+        char data[16384];
+    } buffer;
+    
+    for (;;) {
+        ssize_t len = recv(follow.socket_fd, &buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == ENOBUFS) {
+                // The socket overflowed and events were dropped
+                follow.lost++;
+                follow.resync = 1;
+                continue;
+            }
+            return;  // EAGAIN: drained
+        }
+        
+        struct nlmsghdr *header = &buffer.header;
+        for (; NLMSG_OK(header, (size_t)len); header = NLMSG_NEXT(header, len)) {
+            if (header->nlmsg_type == NLMSG_ERROR || header->nlmsg_type == NLMSG_OVERRUN) {
+                follow.lost++;
+                follow.resync = 1;
+                continue;
+            }
+            struct cn_msg *message = NLMSG_DATA(header);
+            if (message->id.idx != CN_IDX_PROC || message->id.val != CN_VAL_PROC) {
+                continue;
+            }
+            apply_proc_event((struct proc_event *)message->data);
+        }
+    }
+}
+
+// Keep the tree current from proc connector events and redraw it every
+// options.watch_interval seconds. Each event costs a table update (and a
+// few reads for exec), independent of the number of processes. Without
+// the connector this is --watch.
+int follow_processes(int target_pid) {
+    follow.socket_fd = follow_connect();
+    if (follow.socket_fd < 0) {
+        fprintf(stderr, "pstree: proc connector unavailable, polling every %gs\n",
+                options.watch_interval);
+        return watch_processes(target_pid);
+    }
+    
+    catch_watch_signals();
+    mark_highlight_path();
+    
+    double interval_ms = options.watch_interval * 1000;
+    double last_view = now_ms();
+    double next_view = last_view;
+    while (!watch_stop) {
+        double now = now_ms();
+        if (now >= next_view) {
+            if (follow.resync) {
+                // Events were lost, start over from a full scan
+                free_processes();
+                scan_processes();
+                build_process_tree();
+                follow.resync = 0;
+            }
+            mark_highlight_path();
+            
+            // Event rates over the period since the last view
+            char header[256];
+            double seconds = now > last_view ? (now - last_view) / 1000 : 1;
+            int len = snprintf(header, sizeof(header), "pstree: %d processes ", process_count);
+            for (int i = 0; i < EVENT_COUNT; i++) {
+                len += snprintf(header + len, sizeof(header) - len, " %s %.0f/s",
+                                event_names[i], follow.events[i] / seconds);
+                follow.total[i] += follow.events[i];
+                follow.events[i] = 0;
+            }
+            snprintf(header + len, sizeof(header) - len, "  lost %lu", follow.lost);
+            
+            phase_begin(PHASE_PRINT);
+            draw_watch_frame(target_pid, header);
+            phase_end();
+            watch.added = watch.exited = watch.changed = 0;
+            
+            last_view = now;
+            next_view += interval_ms;
+            if (next_view <= now) {
+                next_view = now + interval_ms;
+            }
+        }
+        
+        struct pollfd poll_fd = {follow.socket_fd, POLLIN, 0};
+        int timeout = (int)(next_view - now_ms());
+        if (poll(&poll_fd, 1, timeout > 0 ? timeout : 0) > 0) {
+            phase_begin(PHASE_BUILD);
+            follow_receive();
+            phase_end();
+        }
+    }
+    
+    follow_send(follow.socket_fd, PROC_CN_MCAST_IGNORE);
+    close(follow.socket_fd);
+    follow.socket_fd = -1;
+    out_str("\033[?7h");  // Line wrapping back on
+    out_flush();
+    return 0;
+}
+
+// Offset of str in the snapshot string table, adding it if it is new
+uint32_t snapshot_string(snapshot_strings_t *strings, const char *str) {
+    if (!strings->keys || (unsigned int)(strings->count + 1) * 2 > strings->mask + 1) {
+        unsigned int capacity = strings->keys ? (strings->mask + 1) * 2 : 1024;
+        const char **keys = calloc(capacity, sizeof(const char *));
+        uint32_t *offsets = malloc(capacity * sizeof(uint32_t));
+        if (!keys || !offsets) {
+            perror("malloc");
+            exit(1);
+        }
+        for (unsigned int i = 0; strings->keys && i <= strings->mask; i++) {
+            if (strings->keys[i]) {
+                unsigned int slot = string_hash(strings->keys[i]) & (capacity - 1);
+                while (keys[slot]) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                keys[slot] = strings->keys[i];
+                offsets[slot] = strings->offsets[i];
+            }
+        }
+        free(strings->keys);
+        free(strings->offsets);
+        strings->keys = keys;
+        strings->offsets = offsets;
+        strings->mask = capacity - 1;
+    }
+    
+    unsigned int slot = string_hash(str) & strings->mask;
+    while (strings->keys[slot]) {
+        if (strings->keys[slot] == str || strcmp(strings->keys[slot], str) == 0) {
+            return strings->offsets[slot];
+        }
+        slot = (slot + 1) & strings->mask;
+    }
+    
+    strings->keys[slot] = str;
+    strings->offsets[slot] = (uint32_t)strings->data.len;
+    strings->count++;
+    buffer_append(&strings->data, str, strlen(str) + 1);
+    return strings->offsets[slot];
+}
+
+// Write the process table and its links to path (--save)
+int save_snapshot(const char *path) {
+    for (int i = 0; i < process_count; i++) {
+        processes[i]->table_index = i;
+    }
+    
+    snapshot_strings_t strings = {0};
+    snapshot_string(&strings, "");
+    
+    snapshot_record_t *records = calloc(process_count ? process_count : 1,
+                                        sizeof(snapshot_record_t));
+    uint32_t child_total = 0;
+    for (int i = 0; i < process_count; i++) {
+        child_total += processes[i]->child_count;
+    }
+    uint32_t *children = malloc((child_total ? child_total : 1) * sizeof(uint32_t));
+    if (!records || !children) {
+        perror("malloc");
+        exit(1);
+    }
+    
+    uint32_t next_child = 0;
+    for (int i = 0; i < process_count; i++) {
+        process_t *proc = processes[i];
+        snapshot_record_t *record = &records[i];
+        record->pid = proc->pid;
+        record->ppid = proc->ppid;
+        record->uid = proc->uid;
+        record->pgid = proc->pgid;
+        record->thread_count = proc->thread_count;
+        record->is_thread = proc->is_thread;
+        record->starttime = proc->starttime;
+        record->utime = proc->utime;
+        record->stime = proc->stime;
+        record->rss = proc->rss;
+        record->comm = snapshot_string(&strings, proc->comm);
+        record->cmdline = snapshot_string(&strings, proc_cmdline(proc));
+        record->parent = proc->parent ? (uint32_t)proc->parent->table_index : SNAPSHOT_NONE;
+        record->first_child = next_child;
+        record->child_count = proc->child_count;
+        for (int j = 0; j < proc->child_count; j++) {
+            children[next_child++] = proc->children[j]->table_index;
+        }
+    }
+    
+    // Sections follow the header in order, each 8-byte aligned
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.header_size = sizeof(snapshot_header_t);
+    header.record_size = sizeof(snapshot_record_t);
+    header.record_count = process_count;
+    header.child_count = child_total;
+    header.flags = options.numeric_sort ? SNAPSHOT_BY_PID : 0;
+    header.records_offset = sizeof(snapshot_header_t);
+    header.strings_offset = header.records_offset + (uint64_t)process_count * sizeof(snapshot_record_t);
+    header.strings_size = strings.data.len;
+    header.children_offset = (header.strings_offset + strings.data.len + 7) & ~(uint64_t)7;
+    
+    static const char padding[8] = {0};
+    FILE *file = fopen(path, "wb");
+    int status = -1;
+    if (file &&
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(records, sizeof(snapshot_record_t), process_count, file) == (size_t)process_count &&
+        fwrite(strings.data.data, 1, strings.data.len, file) == strings.data.len &&
+        fwrite(padding, 1, header.children_offset - header.strings_offset - strings.data.len,
+               file) == header.children_offset - header.strings_offset - strings.data.len &&
+        fwrite(children, sizeof(uint32_t), child_total, file) == child_total) {
+        status = 0;
+    }
+    if (file && fclose(file) != 0) {
+        status = -1;
+    }
+    if (status != 0) {
+        perror(path);
+    }
+    
+    free(records);
+    free(children);
+    free(strings.keys);
+    free(strings.offsets);
+    free(strings.data.data);
+    return status;
+}
+
+// Check that the parent and child links of a snapshot form a forest, with
+// indices already known to be in range: every record but the roots is
+// listed in exactly one child range, its parent's, and can be reached from
+// a root, so there is no cycle. Returns -1 if they do not.
+int check_snapshot_links(const snapshot_record_t *records, uint32_t count, const uint32_t *children) {
+    unsigned char *listed = calloc(count ? count : 1, 1);
+    uint32_t *order = malloc((count ? count : 1) * sizeof(uint32_t));
+    if (!listed || !order) {
+        perror("malloc");
+        exit(1);
+    }
+    
+    int valid = 1;
+    for (uint32_t i = 0; i < count && valid; i++) {
+        for (uint32_t j = 0; j < records[i].child_count; j++) {
+            uint32_t child = children[records[i].first_child + j];
+            if (records[child].parent != i || listed[child]) {
+                valid = 0;
+                break;
+            }
+            listed[child] = 1;
+        }
+    }
+    
+    // Walk down from the roots; records on a cycle are never reached
+    uint32_t reached = 0;
+    for (uint32_t i = 0; i < count && valid; i++) {
+        if (records[i].parent == SNAPSHOT_NONE) {
+            order[reached++] = i;
+        } else if (!listed[i]) {
+            valid = 0;
+        }
+    }
+    for (uint32_t next = 0; next < reached && valid; next++) {
+        const snapshot_record_t *record = &records[order[next]];
+        for (uint32_t j = 0; j < record->child_count; j++) {
+            order[reached++] = children[record->first_child + j];
+        }
+    }
+    
+    free(listed);
+    free(order);
+    return valid && reached == count ? 0 : -1;
+}
+
+// Map a snapshot written by --save and turn it into the process table
+// (--load). Names and command lines are used in place from the mapping;
+// only the records and the children pointer arrays are built.
+int load_snapshot(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    void *map = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: not a pstree snapshot\n", path);
+        return -1;
+    }
+    snapshot.map = map;
+    snapshot.size = size;
+    
+    // Check the header and that every section lies inside the file
+    const snapshot_header_t *header = map;
+    const char *base = map;
+    if (size < sizeof(snapshot_header_t) ||
+        memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        fprintf(stderr, "%s: not a pstree snapshot\n", path);
+        return -1;
+    }
+    if (header->version != SNAPSHOT_VERSION || header->byte_order != SNAPSHOT_BYTE_ORDER ||
+        header->header_size != sizeof(snapshot_header_t) ||
+        header->record_size != sizeof(snapshot_record_t)) {
+        fprintf(stderr, "%s: unsupported snapshot version or byte order\n", path);
+        return -1;
+    }
+    // Compared as size - offset, so huge offsets cannot wrap around
+    if (header->records_offset > size || header->records_offset % sizeof(uint64_t) != 0 ||
+        header->record_count > (size - header->records_offset) / sizeof(snapshot_record_t) ||
+        header->strings_offset > size || header->strings_size == 0 ||
+        header->strings_size > size - header->strings_offset ||
+        base[header->strings_offset + header->strings_size - 1] != '\0' ||
+        header->children_offset > size || header->children_offset % sizeof(uint32_t) != 0 ||
+        header->child_count > (size - header->children_offset) / sizeof(uint32_t)) {
+        fprintf(stderr, "%s: truncated snapshot\n", path);
+        return -1;
+    }
+    
+    const snapshot_record_t *records = (const snapshot_record_t *)(base + header->records_offset);
+    const char *strings = base + header->strings_offset;
+    const uint32_t *children = (const uint32_t *)(base + header->children_offset);
+    uint32_t count = header->record_count;
+    
+    process_t *table = arena_alloc(&process_arena, (count ? count : 1) * sizeof(process_t));
+    memset(table, 0, count * sizeof(process_t));
+    free(child_pool);
+    child_pool = malloc((header->child_count ? header->child_count : 1) * sizeof(process_t *));
+    if (!child_pool) {
+        perror("malloc");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < header->child_count; i++) {
+        if (children[i] >= count) {
+            fprintf(stderr, "%s: corrupt snapshot\n", path);
+            return -1;
+        }
+        child_pool[i] = &table[children[i]];
+    }
+    
+    reserve_processes(count);
+    for (uint32_t i = 0; i < count; i++) {
+        const snapshot_record_t *record = &records[i];
+        process_t *proc = &table[i];
+        if (record->comm >= header->strings_size || record->cmdline >= header->strings_size ||
+            (record->parent != SNAPSHOT_NONE && record->parent >= count) ||
+            (uint64_t)record->first_child + record->child_count > header->child_count) {
+            fprintf(stderr, "%s: corrupt snapshot\n", path);
+            return -1;
+        }
+        proc->pid = record->pid;
+        proc->ppid = record->ppid;
+        proc->uid = record->uid;
+        proc->pgid = record->pgid;
+        proc->thread_count = record->thread_count;
+        proc->is_thread = record->is_thread != 0;
+        proc->starttime = record->starttime;
+        proc->utime = record->utime;
+        proc->stime = record->stime;
+        proc->rss = record->rss;
+        proc->comm = strings + record->comm;
+        proc->cmdline = strings + record->cmdline;
+        proc->parent = record->parent != SNAPSHOT_NONE ? &table[record->parent] : NULL;
+        proc->children = child_pool + record->first_child;
+        proc->child_count = record->child_count;
+        table_append(proc);
+    }
+    if (check_snapshot_links(records, count, children) != 0) {
+        fprintf(stderr, "%s: corrupt snapshot\n", path);
+        return -1;
+    }
+    
+    // Children are saved sorted for the saving run's -n, resort if it differs
+    if (!(header->flags & SNAPSHOT_BY_PID) != !options.numeric_sort) {
+        for (uint32_t i = 0; i < count; i++) {
+            sort_processes(table[i].children, table[i].child_count);
+        }
+    }
+    build_pid_index();
+    return 0;
+}
+
+// Order processes by (pid, starttime), which tells a reused PID apart
+int identity_compare(const void *a, const void *b) {
+    const process_t *proc_a = *(process_t *const *)a;
+    const process_t *proc_b = *(process_t *const *)b;
+    if (proc_a->pid != proc_b->pid) {
+        return proc_a->pid < proc_b->pid ? -1 : 1;
+    }
+    return (proc_a->starttime > proc_b->starttime) - (proc_a->starttime < proc_b->starttime);
+}
+
+// Read one --diff input, a snapshot file or "live" for /proc, and move the
+// resulting table out of the globals so the next one can be read
+int read_diff_side(const char *source, diff_side_t *side) {
+    memset(side, 0, sizeof(*side));
+    if (strcmp(source, "live") == 0) {
+        compute_needed_fields();
+        scan_processes();
+        build_process_tree();
+    } else if (load_snapshot(source) != 0) {
+        return -1;
+    }
+    
+    side->processes = processes;
+    side->count = process_count;
+    side->arena = process_arena;
+    side->child_pool = child_pool;
+    side->map = snapshot.map;
+    side->map_size = snapshot.size;
+    processes = NULL;
+    process_count = 0;
+    process_capacity = 0;
+    process_arena.head = NULL;
+    child_pool = NULL;
+    snapshot.map = NULL;
+    free(pid_index.slots);
+    pid_index.slots = NULL;
+    
+    // Sort by identity; /proc and snapshots of it are mostly in PID order
+    side->order = malloc((side->count ? side->count : 1) * sizeof(process_t *));
+    side->merged = calloc(side->count ? side->count : 1, sizeof(process_t *));
+    if (!side->order || !side->merged) {
+        perror("malloc");
+        exit(1);
+    }
+    int sorted = 1;
+    for (int i = 0; i < side->count; i++) {
+        process_t *proc = side->processes[i];
+        proc->table_index = i;
+        if (proc->is_thread) {
+            continue;
+        }
+        if (side->order_count > 0 &&
+            identity_compare(&side->order[side->order_count - 1], &proc) > 0) {
+            sorted = 0;
+        }
+        side->order[side->order_count++] = proc;
+    }
+    if (!sorted) {
+        qsort(side->order, side->order_count, sizeof(process_t *), identity_compare);
+    }
+    return 0;
+}
+
+// Release a --diff input
+void free_diff_side(diff_side_t *side) {
+    free(side->processes);
+    free(side->child_pool);
+    free(side->order);
+    free(side->merged);
+    arena_free(&side->arena);
+    if (side->map) {
+        munmap(side->map, side->map_size);
+    }
+}
+
+// Add a node for source to the diff tree
+process_t *diff_node(process_t *source, int state) {
+    process_t *node = alloc_process(&process_arena);
+    *node = *source;
+    node->parent = NULL;
+    node->children = NULL;
+    node->child_count = 0;
+    node->child_capacity = 0;
+    node->diff_state = state;
+    node->diff_shown = 0;
+    // The inputs have their own name strings, share one per name again
+    node->comm = intern(&comm_names, node->comm);
+    table_append(node);
+    return node;
+}
+
+// The diff tree node of proc's parent within one input
+process_t *merged_parent(diff_side_t *side, process_t *proc) {
+    return proc->parent ? side->merged[proc->parent->table_index] : NULL;
+}
+
+// Merge two tables into one tree of every process in either of them.
+// Processes are matched on (pid, starttime) with one pass over the two
+// sorted lists. Processes in both take their parent from B and are
+// marked reparented when it is not the process that was their parent
+// in A; processes only in A stay under their parent from A. Only the
+// changes, what lies below them and the path to them are displayed.
+// Returns the number of changed processes.
+int build_diff_tree(diff_side_t *from, diff_side_t *to) {
+    reserve_processes(from->order_count + to->order_count);
+    
+    int i = 0;
+    int j = 0;
+    while (i < from->order_count || j < to->order_count) {
+        int order = i >= from->order_count ? 1 : j >= to->order_count ? -1 :
+                    identity_compare(&from->order[i], &to->order[j]);
+        if (order < 0) {
+            process_t *proc = from->order[i++];
+            from->merged[proc->table_index] = diff_node(proc, DIFF_REMOVED);
+        } else if (order > 0) {
+            process_t *proc = to->order[j++];
+            to->merged[proc->table_index] = diff_node(proc, DIFF_ADDED);
+        } else {
+            process_t *node = diff_node(to->order[j], DIFF_SAME);
+            from->merged[from->order[i++]->table_index] = node;
+            to->merged[to->order[j++]->table_index] = node;
+        }
+    }
+    
+    for (j = 0; j < to->order_count; j++) {
+        process_t *proc = to->order[j];
+        to->merged[proc->table_index]->parent = merged_parent(to, proc);
+    }
+    for (i = 0; i < from->order_count; i++) {
+        process_t *proc = from->order[i];
+        process_t *node = from->merged[proc->table_index];
+        if (node->diff_state == DIFF_REMOVED) {
+            node->parent = merged_parent(from, proc);
+        } else if (node->parent != merged_parent(from, proc)) {
+            node->diff_state = DIFF_REPARENTED;
+        }
+    }
+    link_children();
+    build_pid_index();
+    
+    // Parents come before their children in breadth-first order: mark
+    // what is inside a changed subtree top-down, what lies above a change
+    // bottom-up
+    process_t **order = malloc((process_count ? process_count : 1) * sizeof(process_t *));
+    if (!order) {
+        perror("malloc");
+        exit(1);
+    }
+    int count = 0;
+    for (i = 0; i < process_count; i++) {
+        if (!processes[i]->parent) {
+            order[count++] = processes[i];
+        }
+    }
+    for (i = 0; i < count; i++) {
+        process_t *proc = order[i];
+        proc->diff_shown = proc->diff_state != DIFF_SAME ||
+                           (proc->parent && proc->parent->diff_shown);
+        for (j = 0; j < proc->child_count; j++) {
+            order[count++] = proc->children[j];
+        }
+    }
+    int changes = 0;
+    for (i = count - 1; i >= 0; i--) {
+        process_t *proc = order[i];
+        changes += proc->diff_state != DIFF_SAME;
+        if (proc->diff_shown && proc->parent) {
+            proc->parent->diff_shown = 1;
+        }
+    }
+    free(order);
+    return changes;
+}
+
+// Print the +/-/~ marker of a --diff node
+void print_diff_marker(process_t *proc) {
+    static const char markers[] = " +-~";
+    if (proc->diff_state != DIFF_SAME) {
+        out_write(&markers[proc->diff_state], 1);
+    }
+}
+
+// Listen on the Unix socket at path, readable only by this user. A stale
+// socket file is replaced, one a daemon still answers on is not. The socket
+// is bound under path.new and renamed once listening, so a client never
+// finds a socket file that refuses connections.
+int daemon_listen(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) + strlen(".new") >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
     }
+    strcpy(address.sun_path, path);
     
-    // Print process name
-    if (options.show_args && strlen(proc->cmdline) > 0) {
-        printf("%s", proc->cmdline);
-    } else {
-        printf("%s", proc->comm);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
     }
-    
-    // Print PID if requested
-    if (options.show_pids) {
-        printf("(%d)", proc->pid);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+        fprintf(stderr, "%s: a daemon is already running\n", path);
+        close(fd);
+        return -1;
     }
+    close(fd);
     
-    // Print PGID if requested
-    if (options.show_pgids && proc->pgid != -1) {
-        printf("[%d]", proc->pgid);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
     }
-    
-    // Print UID change if requested
-    if (options.uid_changes && proc->ppid != 0) {
-        // Find parent to compare UID
-        process_t *parent = NULL;
-        for (int i = 0; i < process_count; i++) {
-            if (processes[i]->pid == proc->ppid) {
-                parent = processes[i];
-                break;
-            }
-        }
-        
-        if (parent && parent->uid != proc->uid && proc->uid != -1) {
-            struct passwd *pw = getpwuid(proc->uid);
-            if (pw) {
-                printf("(user: %s)", pw->pw_name);
-            } else {
-                printf("(uid: %d)", proc->uid);
-            }
-        }
+    strcat(address.sun_path, ".new");
+    unlink(address.sun_path);
+    mode_t mask = umask(0077);
+    int bound = bind(fd, (struct sockaddr *)&address, sizeof(address));
+    umask(mask);
+    if (bound != 0 || listen(fd, 64) != 0 || rename(address.sun_path, path) != 0) {
+        perror(path);
+        unlink(address.sun_path);
+        close(fd);
+        return -1;
     }
-    
-    if (highlight) {
-        printf("\033[0m"); // Reset text formatting
+    return fd;
+}
+
+// Sort the children arrays by name or by PID as the current options ask,
+// unless they are in that order already. --sort and the compact grouping
+// reorder copies in print_view(), so the table keeps this order.
+void daemon_order_table(void) {
+    if (server.numeric_order == options.numeric_sort) {
+        return;
     }
-    
-    printf("\n");
-    
-    // Print children
-    if (proc->child_count > 0) {
-        char new_prefix[1024];
-        snprintf(new_prefix, sizeof(new_prefix), "%s%s", prefix, continue_prefix);
-        
-        for (int i = 0; i < proc->child_count; i++) {
-            int child_is_last = (i == proc->child_count - 1);
-            print_tree(proc->children[i], new_prefix, child_is_last);
-        }
+    for (int i = 0; i < process_count; i++) {
+        sort_processes(processes[i]->children, processes[i]->child_count);
     }
+    server.numeric_order = options.numeric_sort;
 }
 
-// Check if a name represents a thread
-int is_thread_name(const char *name) {
-    return name && name[0] == '{' && name[strlen(name) - 1] == '}';
+// Write all of data to a socket. Returns -1 when the peer has gone away.
+int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd poll_fd = {fd, POLLOUT, 0};
+                if (poll(&poll_fd, 1, DAEMON_TIMEOUT_MS) > 0) {
+                    continue;
+                }
+            }
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
 }
 
-// Merge threads into their parent processes
-void merge_threads(void) {
-    // Thread counting is now done during scanning
-    // This function is kept for compatibility
-    return;
+// Read a request into server.request until the client shuts down its
+// side: the client's arguments, each terminated by a NUL
+int daemon_read_request(int fd) {
+    server.request.len = 0;
+    for (;;) {
+        char buf[4096];
+        ssize_t len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len == 0) {
+            return 0;
+        }
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            struct pollfd poll_fd = {fd, POLLIN, 0};
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+                poll(&poll_fd, 1, DAEMON_TIMEOUT_MS) > 0) {
+                continue;
+            }
+            return -1;
+        }
+        if (server.request.len + len > DAEMON_MAX_REQUEST) {
+            return -1;
+        }
+        buffer_append(&server.request, buf, len);
+    }
 }
 
-// Print compact tree (like system pstree)
-void print_compact_tree(process_t *proc, const char *prefix, int is_last) {
-    if (!proc || proc->is_thread) return;
-    
-    // Print current process
-    printf("%s", prefix);
-    
-    // Choose the appropriate tree characters
-    const char *branch, *continue_prefix;
-    if (options.ascii_mode) {
-        branch = is_last ? "`-" : "|-";
-        continue_prefix = is_last ? "  " : "| ";
-    } else {
-        branch = is_last ? "└─" : "├─";
-        continue_prefix = is_last ? "  " : "│ ";
+// Answer one client: parse its arguments like a command line, refresh the
+// table if it is older than allowed, and send a header line followed by
+// the output. The header is "OK" with timings or "ERR" with a message.
+void daemon_request(int client_fd) {
+    double start = now_ms();
+    char header[256];
+    if (daemon_read_request(client_fd) != 0 || server.request.len == 0 ||
+        server.request.data[server.request.len - 1] != '\0') {
+        snprintf(header, sizeof(header), "ERR invalid request\n");
+        send_all(client_fd, header, strlen(header));
+        server.errors++;
+        return;
     }
     
-    printf("%s", branch);
+    char *args[256];
+    int arg_count = 0;
+    args[arg_count++] = "pstree";
+    for (size_t pos = 0; pos < server.request.len && arg_count < 255;
+         pos += strlen(server.request.data + pos) + 1) {
+        args[arg_count++] = server.request.data + pos;
+    }
+    args[arg_count] = NULL;
     
-    // Check if this process should be highlighted
-    int highlight = should_highlight(proc);
-    if (highlight) {
-        printf("\033[1m"); // Bold text
+    // Parse into the global options, then keep the daemon's own aside
+    __typeof__(options) daemon_options = options;
+    memset(&options, 0, sizeof(options));
+    options.proc_root = daemon_options.proc_root;
+    options.max_age = -1;
+    int target_pid = 1;
+    optind = 0;
+    opterr = 0;
+    int status = parse_options(arg_count, args, &target_pid);
+    __typeof__(options) request = options;
+    options = daemon_options;
+    if (status >= 0 || request.daemon || request.watch_interval > 0 || request.save_file ||
+        request.load_file || request.diff_from) {
+        snprintf(header, sizeof(header), "ERR invalid request\n");
+        send_all(client_fd, header, strlen(header));
+        server.errors++;
+        return;
     }
     
-    // Print process name
-    if (options.show_args && strlen(proc->cmdline) > 0) {
-        printf("%s", proc->cmdline);
-    } else {
-        printf("%s", proc->comm);
+    // Bounded staleness: the daemon's --max-age, or the client's if lower
+    double max_age = options.max_age;
+    if (request.max_age >= 0 && request.max_age < max_age) {
+        max_age = request.max_age;
+    }
+    double refresh_ms = 0;
+    if (start - server.refreshed_at > max_age * 1000) {
+        daemon_order_table();   // Refreshes insert in the daemon's order
+        refresh_processes();
+        free(uid_index.slots);
+        uid_index.slots = NULL;
+        server.highlighted = 0;
+        server.refreshed_at = start;
+        server.refreshes++;
+        refresh_ms = now_ms() - start;
     }
+    double age_ms = now_ms() - server.refreshed_at;
     
-    // Print PID if requested
-    if (options.show_pids) {
-        printf("(%d)", proc->pid);
+    double render_start = now_ms();
+    options = request;
+    daemon_order_table();
+    if (options.highlight_pid > 0 || server.highlighted) {
+        mark_highlight_path();
+        server.highlighted = options.highlight_pid > 0;
     }
+    server.response.len = 0;
+    output.capture = &server.response;
+    output.trees = 0;
+    status = print_selection(target_pid);
+    out_flush();
+    output.capture = NULL;
+    options = daemon_options;
+    double render_ms = now_ms() - render_start;
     
-    // Print PGID if requested
-    if (options.show_pgids && proc->pgid != -1) {
-        printf("[%d]", proc->pgid);
+    if (status != 0) {
+        snprintf(header, sizeof(header), "ERR Process %d not found\n", target_pid);
+        server.response.len = 0;
+        server.errors++;
+    } else {
+        snprintf(header, sizeof(header),
+                 "OK age_ms=%.3f refresh_ms=%.3f render_ms=%.3f latency_ms=%.3f bytes=%zu "
+                 "processes=%d\n", age_ms, refresh_ms, render_ms, now_ms() - start,
+                 server.response.len, process_count);
+    }
+    if (send_all(client_fd, header, strlen(header)) == 0) {
+        send_all(client_fd, server.response.data, server.response.len);
     }
     
-    // Print thread count if there are threads
-    if (proc->thread_count > 0) {
-        printf("───%d*[{%s}]", proc->thread_count, proc->comm);
+    double latency = now_ms() - start;
+    server.requests++;
+    server.latency_total_ms += latency;
+    if (latency > server.latency_max_ms) {
+        server.latency_max_ms = latency;
     }
+}
+
+// Serve queries on server.listen_fd until SIGINT or SIGTERM
+int daemon_serve(void) {
+    catch_watch_signals();
+    qsort(watch.pids, watch.pid_count, sizeof(pid_entry_t), pid_entry_compare);
+    server.refreshed_at = now_ms() - phase_ms[PHASE_SCAN] - phase_ms[PHASE_BUILD] -
+                          phase_ms[PHASE_SORT];
+    server.numeric_order = options.numeric_sort;
+    options.sort_key = SORT_NONE;   // Queries ask for their own --sort
     
-    // Print UID change if requested
-    if (options.uid_changes && proc->ppid != 0) {
-        // Find parent to compare UID
-        process_t *parent = NULL;
-        for (int i = 0; i < process_count; i++) {
-            if (processes[i]->pid == proc->ppid) {
-                parent = processes[i];
-                break;
-            }
+    while (!watch_stop) {
+        struct pollfd poll_fd = {server.listen_fd, POLLIN, 0};
+        if (poll(&poll_fd, 1, -1) <= 0) {
+            continue;  // Interrupted by a signal, watch_stop tells which
         }
-        
-        if (parent && parent->uid != proc->uid && proc->uid != -1) {
-            struct passwd *pw = getpwuid(proc->uid);
-            if (pw) {
-                printf("(user: %s)", pw->pw_name);
-            } else {
-                printf("(uid: %d)", proc->uid);
-            }
+        int client_fd = accept4(server.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            continue;
         }
+        daemon_request(client_fd);
+        close(client_fd);
     }
     
-    if (highlight) {
-        printf("\033[0m"); // Reset text formatting
+    close(server.listen_fd);
+    server.listen_fd = -1;
+    unlink(options.socket_path);
+    if (options.stats) {
+        fprintf(stderr, "pstree-daemon requests=%lu errors=%lu refreshes=%lu "
+                "latency.mean_ms=%.3f latency.max_ms=%.3f\n", server.requests, server.errors,
+                server.refreshes, server.requests ? server.latency_total_ms / server.requests : 0.0,
+                server.latency_max_ms);
     }
-    
-    // Check for single-child chain compression
-    process_t *current = proc;
-    int chain_length = 0;
-    
-    // Count non-thread children
-    int non_thread_children = 0;
-    for (int i = 0; i < current->child_count; i++) {
-        if (!current->children[i]->is_thread) {
-            non_thread_children++;
-        }
+    free(server.request.data);
+    free(server.response.data);
+    return 0;
+}
+
+// Send this command line to the daemon on --socket and copy its answer to
+// stdout. Returns the exit status, or -1 when no daemon is listening.
+int query_daemon(int argc, char *argv[]) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(options.socket_path) >= sizeof(address.sun_path)) {
+        return -1;
     }
-    
-    // If this process has exactly one non-thread child, and that child also has one child,
-    // we can compress the display
-    if (non_thread_children == 1 && !options.compact_not) {
-        process_t *single_child = NULL;
-        for (int i = 0; i < current->child_count; i++) {
-            if (!current->children[i]->is_thread) {
-                single_child = current->children[i];
-                break;
-            }
-        }
-        
-        if (single_child) {
-            int single_child_non_thread_children = 0;
-            for (int i = 0; i < single_child->child_count; i++) {
-                if (!single_child->children[i]->is_thread) {
-                    single_child_non_thread_children++;
-                }
-            }
-            
-            // Always compress single-child chains, even if the child has multiple children
-            // This matches system pstree behavior
-            // Print the chain on the same line
-            printf("───%s", single_child->comm);
-            if (options.show_pids) {
-                printf("(%d)", single_child->pid);
-            }
-            if (single_child->thread_count > 0) {
-                printf("───%d*[{%s}]", single_child->thread_count, single_child->comm);
-            }
-            
-            // If this child has multiple children, add a branch indicator
-            int child_non_thread_count = 0;
-            for (int i = 0; i < single_child->child_count; i++) {
-                if (!single_child->children[i]->is_thread) {
-                    child_non_thread_count++;
-                }
-            }
-            
-            // Continue the chain if the child also has only one child
-            current = single_child;
-            if (child_non_thread_count == 1) {
-                while (current && current->child_count > 0) {
-                    process_t *next = NULL;
-                    int next_non_thread_children = 0;
-                    
-                    // Find the single non-thread child
-                    for (int i = 0; i < current->child_count; i++) {
-                        if (!current->children[i]->is_thread) {
-                            if (next == NULL) {
-                                next = current->children[i];
-                            }
-                            next_non_thread_children++;
-                        }
-                    }
-                    
-                    if (next_non_thread_children == 1 && next) {
-                        printf("───%s", next->comm);
-                        if (options.show_pids) {
-                            printf("(%d)", next->pid);
-                        }
-                        if (next->thread_count > 0) {
-                            printf("───%d*[{%s}]", next->thread_count, next->comm);
-                        }
-                        current = next;
-                        
-                        // Update child count for branch indicator logic
-                        child_non_thread_count = 0;
-                        for (int i = 0; i < current->child_count; i++) {
-                            if (!current->children[i]->is_thread) {
-                                child_non_thread_count++;
-                            }
-                        }
-                        
-                        if (child_non_thread_count != 1) {
-                            break;
-                        }
-                    } else {
-                        break;
-                    }
-                }
-            }
-        }
+    strcpy(address.sun_path, options.socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
     }
     
-    printf("\n");
+    byte_buffer_t request = {0};
+    for (int i = 1; i < argc; i++) {
+        buffer_append(&request, argv[i], strlen(argv[i]) + 1);
+    }
+    int sent = send_all(fd, request.data, request.len);
+    free(request.data);
+    shutdown(fd, SHUT_WR);
     
-    // Print children
-    if (current->child_count > 0) {
-        char new_prefix[1024];
-        
-        // If we compressed a chain, we need to adjust the prefix depth
-        // Calculate how many levels we compressed
-        int compression_depth = 0;
-        process_t *temp = proc;
-        while (temp != current) {
-            compression_depth++;
-            // Find the single non-thread child that led to current
-            process_t *next = NULL;
-            for (int i = 0; i < temp->child_count; i++) {
-                if (!temp->children[i]->is_thread) {
-                    next = temp->children[i];
-                    break;
-                }
-            }
-            if (next == NULL || next == current) {
-                break;
-            }
-            temp = next;
-        }
-        
-        // Build the correct prefix for the compressed chain
-        snprintf(new_prefix, sizeof(new_prefix), "%s%s", prefix, continue_prefix);
-        
-        // Calculate the exact indentation needed to align with the end of the compressed chain
-        if (compression_depth > 0) {
-            // Count the length of the compressed chain text
-            int chain_length = 0;
-            process_t *temp = proc;
-            
-            // Add length of the tree characters and first process name
-            if (options.ascii_mode) {
-                chain_length += 2; // "`-" or "|-"
-            } else {
-                chain_length += 2; // "└─" or "├─" (each is 3 bytes but displays as 2 chars)
-            }
-            chain_length += strlen(temp->comm);
-            
-            // Add length for each compressed process in the chain
-            while (temp != current) {
-                process_t *next = NULL;
-                for (int i = 0; i < temp->child_count; i++) {
-                    if (!temp->children[i]->is_thread) {
-                        next = temp->children[i];
-                        break;
-                    }
-                }
-                if (next == NULL || next == current) {
-                    break;
-                }
-                chain_length += 3; // "───"
-                chain_length += strlen(next->comm);
-                temp = next;
-            }
-            
-            // Add spaces to align with the end of the chain
-            for (int i = 0; i < chain_length; i++) {
-                strncat(new_prefix, " ", sizeof(new_prefix) - strlen(new_prefix) - 1);
-            }
-        }
-        
-        int non_thread_children = 0;
-        for (int i = 0; i < current->child_count; i++) {
-            if (!current->children[i]->is_thread) {
-                non_thread_children++;
-            }
+    // The header line first, then the output as it arrives
+    char buf[65536];
+    size_t have = 0;
+    char *newline = NULL;
+    while (sent == 0 && !newline && have < sizeof(buf)) {
+        ssize_t len = read(fd, buf + have, sizeof(buf) - have);
+        if (len < 0 && errno == EINTR) {
+            continue;
         }
-        
-        int printed_children = 0;
-        for (int i = 0; i < current->child_count; i++) {
-            if (current->children[i]->is_thread) continue;
-            
-            int child_is_last = (printed_children == non_thread_children - 1);
-            print_compact_tree(current->children[i], new_prefix, child_is_last);
-            printed_children++;
+        if (len <= 0) {
+            break;
         }
+        newline = memchr(buf + have, '\n', len);
+        have += len;
     }
-}
-
-// Check if a process is an ancestor of another
-int is_ancestor_of(int ancestor_pid, int descendant_pid) {
-    if (ancestor_pid == descendant_pid) {
+    if (!newline) {
+        fprintf(stderr, "pstree: no answer from the daemon on %s\n", options.socket_path);
+        close(fd);
+        return 1;
+    }
+    *newline = '\0';
+    char header[256];
+    snprintf(header, sizeof(header), "%.255s", buf);
+    if (strncmp(header, "OK", 2) != 0) {
+        fprintf(stderr, "%s\n", strncmp(header, "ERR ", 4) == 0 ? header + 4 : header);
+        close(fd);
         return 1;
     }
     
-    for (int i = 0; i < process_count; i++) {
-        if (processes[i]->pid == descendant_pid) {
-            if (processes[i]->ppid == 0) {
-                return 0; // Reached root
-            }
-            return is_ancestor_of(ancestor_pid, processes[i]->ppid);
+    out_write(newline + 1, have - (newline + 1 - buf));
+    for (;;) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR) {
+            continue;
         }
+        if (len <= 0) {
+            break;
+        }
+        out_write(buf, len);
     }
-    return 0;
-}
-
-// Check if a process should be highlighted
-int should_highlight(process_t *proc) {
-    if (options.highlight_pid <= 0) {
-        return 0;
-    }
+    out_flush();
+    close(fd);
     
-    return is_ancestor_of(proc->pid, options.highlight_pid) || 
-           proc->pid == options.highlight_pid;
-}
-
-// Free all allocated memory
-void free_processes(void) {
-    for (int i = 0; i < process_count; i++) {
-        if (processes[i]->children) {
-            free(processes[i]->children);
-        }
-        free(processes[i]);
+    if (options.stats) {
+        fprintf(stderr, "pstree-stats source=daemon%s\n", header + 2);
     }
+    return 0;
 }
 
 // Print usage information
@@ -665,12 +4947,33 @@ void print_usage(void) {
     printf("  -t, --thread-names  show thread names\n");
     printf("  -u, --uid-changes   show uid transitions\n");
     printf("  -h, --help          display this help and exit\n");
+    printf("      --jobs N        read /proc with N threads\n");
+    printf("      --io-uring      batch the /proc reads through io_uring, one ring per\n");
+    printf("                      thread (falls back when the kernel lacks it)\n");
+    printf("      --stats         print counters and phase timings to stderr, one line\n");
+    printf("      --proc-root DIR read processes from DIR instead of /proc\n");
+    printf("      --watch SECONDS redraw the tree every SECONDS, rereading only changes\n");
+    printf("      --follow        update the tree from kernel process events, redraw\n");
+    printf("                      every --watch SECONDS (default 1)\n");
+    printf("      --save FILE     also write the process table to a binary snapshot\n");
+    printf("      --load FILE     print a snapshot written by --save instead of /proc\n");
+    printf("      --diff A B      show processes added (+), removed (-) and reparented (~)\n");
+    printf("                      from A to B, each a snapshot file or \"live\"\n");
+    printf("      --totals        show RSS, CPU time, processes and threads per subtree\n");
+    printf("      --sort KEY      order siblings by subtree rss or cpu, largest first\n");
+    printf("      --format FORMAT text (default), json (nested trees) or ndjson (one\n");
+    printf("                      process per line)\n");
+    printf("      --daemon        keep the table in memory and answer queries on --socket\n");
+    printf("      --socket PATH   socket of the daemon; without --daemon, ask it for the\n");
+    printf("                      tree the other options select (scans when it is down)\n");
+    printf("      --max-age SECONDS  reread /proc when the daemon's table is older\n");
+    printf("                      (daemon default %g, a query may ask for less)\n", DAEMON_MAX_AGE);
 }
 
-int main(int argc, char *argv[]) {
+// Parse the command line into options and target_pid. Returns -1 to go
+// on, or the exit status when the program is done (--help or an error).
+int parse_options(int argc, char *argv[], int *target_pid) {
     int option;
-    int target_pid = 1; // Default to init process
-    
     static struct option long_options[] = {
         {"arguments", no_argument, 0, 'a'},
         {"ascii", no_argument, 0, 'A'},
@@ -682,6 +4985,21 @@ int main(int argc, char *argv[]) {
         {"thread-names", no_argument, 0, 't'},
         {"uid-changes", no_argument, 0, 'u'},
         {"help", no_argument, 0, 'h'},
+        {"jobs", required_argument, 0, OPT_JOBS},
+        {"stats", no_argument, 0, OPT_STATS},
+        {"proc-root", required_argument, 0, OPT_PROC_ROOT},
+        {"watch", required_argument, 0, OPT_WATCH},
+        {"follow", no_argument, 0, OPT_FOLLOW},
+        {"save", required_argument, 0, OPT_SAVE},
+        {"load", required_argument, 0, OPT_LOAD},
+        {"diff", required_argument, 0, OPT_DIFF},
+        {"totals", no_argument, 0, OPT_TOTALS},
+        {"sort", required_argument, 0, OPT_SORT},
+        {"format", required_argument, 0, OPT_FORMAT},
+        {"daemon", no_argument, 0, OPT_DAEMON},
+        {"socket", required_argument, 0, OPT_SOCKET},
+        {"max-age", required_argument, 0, OPT_MAX_AGE},
+        {"io-uring", no_argument, 0, OPT_IO_URING},
         {0, 0, 0, 0}
     };
     
@@ -723,6 +5041,84 @@ int main(int argc, char *argv[]) {
             case 'h':
                 print_usage();
                 return 0;
+            case OPT_JOBS:
+                options.jobs = atoi(optarg);
+                if (options.jobs < 1) {
+                    fprintf(stderr, "Invalid job count: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_STATS:
+                options.stats = 1;
+                break;
+            case OPT_PROC_ROOT:
+                options.proc_root = optarg;
+                break;
+            case OPT_WATCH:
+                options.watch_interval = atof(optarg);
+                if (options.watch_interval <= 0) {
+                    fprintf(stderr, "Invalid watch interval: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_FOLLOW:
+                options.follow = 1;
+                break;
+            case OPT_SAVE:
+                options.save_file = optarg;
+                break;
+            case OPT_LOAD:
+                options.load_file = optarg;
+                break;
+            case OPT_DIFF:
+                if (optind >= argc) {
+                    fprintf(stderr, "--diff needs two tables: --diff A B\n");
+                    return 1;
+                }
+                options.diff_from = optarg;
+                options.diff_to = argv[optind++];
+                break;
+            case OPT_TOTALS:
+                options.show_totals = 1;
+                break;
+            case OPT_SORT:
+                if (strcmp(optarg, "rss") == 0) {
+                    options.sort_key = SORT_RSS;
+                } else if (strcmp(optarg, "cpu") == 0) {
+                    options.sort_key = SORT_CPU;
+                } else {
+                    fprintf(stderr, "Invalid sort key: %s (rss or cpu)\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_FORMAT:
+                if (strcmp(optarg, "text") == 0) {
+                    options.format = FORMAT_TEXT;
+                } else if (strcmp(optarg, "json") == 0) {
+                    options.format = FORMAT_JSON;
+                } else if (strcmp(optarg, "ndjson") == 0) {
+                    options.format = FORMAT_NDJSON;
+                } else {
+                    fprintf(stderr, "Invalid format: %s (text, json or ndjson)\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_DAEMON:
+                options.daemon = 1;
+                break;
+            case OPT_SOCKET:
+                options.socket_path = optarg;
+                break;
+            case OPT_MAX_AGE:
+                options.max_age = atof(optarg);
+                if (options.max_age < 0) {
+                    fprintf(stderr, "Invalid maximum age: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPT_IO_URING:
+                options.io_uring = 1;
+                break;
             case '?':
                 print_usage();
                 return 1;
@@ -732,50 +5128,185 @@ int main(int argc, char *argv[]) {
         }
     }
     
+    if (options.follow && options.watch_interval <= 0) {
+        options.watch_interval = 1;
+    }
+    if ((options.load_file || options.diff_from) &&
+        (options.watch_interval > 0 || options.save_file)) {
+        fprintf(stderr, "--load and --diff cannot be combined with --watch, --follow or --save\n");
+        return 1;
+    }
+    if (options.format != FORMAT_TEXT && (options.watch_interval > 0 || options.diff_from)) {
+        fprintf(stderr, "--format cannot be combined with --watch, --follow or --diff\n");
+        return 1;
+    }
+    if (options.daemon && !options.socket_path) {
+        fprintf(stderr, "--daemon needs --socket PATH\n");
+        return 1;
+    }
+    if (options.socket_path && (options.watch_interval > 0 || options.save_file ||
+                                options.load_file || options.diff_from)) {
+        fprintf(stderr, "--daemon and --socket cannot be combined with --watch, --follow, "
+                        "--save, --load or --diff\n");
+        return 1;
+    }
+    if (options.daemon && optind < argc) {
+        fprintf(stderr, "--daemon takes no PID or USER, queries give them\n");
+        return 1;
+    }
+    
     // Handle optional PID argument
     if (optind < argc) {
         if (is_number(argv[optind])) {
-            target_pid = atoi(argv[optind]);
+            *target_pid = atoi(argv[optind]);
+            // Only that subtree is read, unless the whole table is needed
+            if (options.watch_interval <= 0 && !options.diff_from && !options.load_file &&
+                !options.save_file) {
+                options.subtree_pid = *target_pid;
+            }
         } else {
-            // Handle USER argument (simplified - just show error)
-            fprintf(stderr, "User filtering not implemented\n");
+            struct passwd *pw = getpwnam(argv[optind]);
+            if (!pw) {
+                fprintf(stderr, "No such user name: %s\n", argv[optind]);
+                return 1;
+            }
+            options.user = argv[optind];
+            options.user_uid = (int)pw->pw_uid;
+            if (options.watch_interval > 0 || options.diff_from) {
+                fprintf(stderr, "USER cannot be combined with --watch, --follow or --diff\n");
+                return 1;
+            }
+        }
+    }
+    
+    return -1;
+}
+
+// bench.c includes this file with PSTREE_NO_MAIN to reuse the tree code
+#ifndef PSTREE_NO_MAIN
+int main(int argc, char *argv[]) {
+    run_started = now_ms();
+    int target_pid = 1; // Default to init process
+    options.proc_root = "/proc";
+    options.max_age = -1;
+    int status = parse_options(argc, argv, &target_pid);
+    if (status >= 0) {
+        return status;
+    }
+    
+    // Ask a running daemon first, the local scan below is the fallback
+    if (options.socket_path && !options.daemon) {
+        status = query_daemon(argc, argv);
+        if (status >= 0) {
+            return status;
+        }
+        fprintf(stderr, "pstree: no daemon on %s, scanning %s\n", options.socket_path,
+                options.proc_root);
+    }
+    if (options.daemon) {
+        server.listen_fd = daemon_listen(options.socket_path);
+        if (server.listen_fd < 0) {
             return 1;
         }
+        if (options.max_age < 0) {
+            options.max_age = DAEMON_MAX_AGE;
+        }
     }
     
-    // Scan all processes
-    scan_processes();
+    // A loaded snapshot replaces both the scan and the tree build
+    phase_begin(PHASE_SCAN);
+    diff_side_t diff_sides[2];
+    if (options.diff_from) {
+        if (read_diff_side(options.diff_from, &diff_sides[0]) != 0) {
+            free_processes();
+            return 1;
+        }
+        if (read_diff_side(options.diff_to, &diff_sides[1]) != 0) {
+            free_diff_side(&diff_sides[0]);
+            free_processes();
+            return 1;
+        }
+        phase_end();
+        
+        phase_begin(PHASE_BUILD);
+        build_diff_tree(&diff_sides[0], &diff_sides[1]);
+        phase_end();
+    } else if (options.load_file) {
+        if (load_snapshot(options.load_file) != 0) {
+            free_processes();
+            return 1;
+        }
+        phase_end();
+    } else {
+        // Scan all processes, reading only the fields the options need
+        compute_needed_fields();
+        scan_processes();
+        phase_end();
+        
+        // Build process tree
+        phase_begin(PHASE_BUILD);
+        build_process_tree();
+        phase_end();
+    }
     
-    // Build process tree
-    build_process_tree();
+    if (options.save_file && save_snapshot(options.save_file) != 0) {
+        free_processes();
+        return 1;
+    }
     
     // Merge threads if not showing them explicitly
     merge_threads();
     
-    // Find the root process
-    process_t *root = NULL;
-    for (int i = 0; i < process_count; i++) {
-        if (processes[i]->pid == target_pid) {
-            root = processes[i];
-            break;
+    // Keep the table and answer queries until interrupted
+    if (options.daemon) {
+        status = daemon_serve();
+        if (options.stats) {
+            print_stats();
         }
+        free_processes();
+        return status;
     }
     
-    if (!root) {
+    // Keep the table and redraw until interrupted
+    if (options.watch_interval > 0) {
+        int status = options.follow ? follow_processes(target_pid)
+                                    : watch_processes(target_pid);
+        if (options.stats) {
+            print_stats();
+        }
+        free_processes();
+        return status;
+    }
+    
+    // Mark the -H path once instead of checking ancestry per printed node
+    mark_highlight_path();
+    
+    // Print the tree using compact format by default
+    phase_begin(PHASE_PRINT);
+    if (print_selection(target_pid) != 0) {
         fprintf(stderr, "Process %d not found\n", target_pid);
         free_processes();
+        if (options.diff_from) {
+            free_diff_side(&diff_sides[0]);
+            free_diff_side(&diff_sides[1]);
+        }
         return 1;
     }
     
-    // Print the tree using compact format by default
-    if (options.compact_not) {
-        print_tree(root, "", 1);
-    } else {
-        print_compact_tree(root, "", 1);
+    out_flush();
+    phase_end();
+    
+    if (options.stats) {
+        print_stats();
     }
     
     // Cleanup
     free_processes();
+    if (options.diff_from) {
+        free_diff_side(&diff_sides[0]);
+        free_diff_side(&diff_sides[1]);
+    }
     
     return 0;
 }
+#endif